@@ -0,0 +1,584 @@
+#ifndef _COR_ASYNC_HPP_
+#define _COR_ASYNC_HPP_
+
+#include <cor/mt.hpp>
+
+#include <vector>
+#include <utility>
+#include <exception>
+#include <stdexcept>
+
+namespace cor
+{
+namespace async
+{
+
+template <typename T> class Future;
+template <typename T> class Promise;
+
+namespace detail
+{
+
+template <typename T>
+class Storage
+{
+public:
+    Storage() : has_value_(false) {}
+    ~Storage()
+    {
+        if (has_value_)
+            ptr()->~T();
+    }
+
+    template <typename U>
+    void set(U &&v)
+    {
+        new (&data_) T(std::forward<U>(v));
+        has_value_ = true;
+    }
+
+    T take() { return std::move(*ptr()); }
+
+    template <typename FnT>
+    auto apply(FnT &fn) -> decltype(fn(std::declval<T>()))
+    {
+        return fn(take());
+    }
+
+private:
+    Storage(Storage const &);
+    Storage& operator =(Storage const &);
+
+    T *ptr() { return reinterpret_cast<T*>(&data_); }
+
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type data_;
+    bool has_value_;
+};
+
+template <>
+class Storage<void>
+{
+public:
+    void set() {}
+    void take() {}
+
+    template <typename FnT>
+    auto apply(FnT &fn) -> decltype(fn())
+    {
+        return fn();
+    }
+};
+
+/// shared state of the promise and the future. Callback is called by
+/// the thread making the state ready or immediately if it is already
+/// ready
+template <typename T>
+class State
+{
+public:
+    State() : is_ready_(false) {}
+
+    template <typename... Args>
+    bool set_value(Args&&... args)
+    {
+        Task callback;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (is_ready_)
+                return false;
+            value_.set(std::forward<Args>(args)...);
+            is_ready_ = true;
+            callback = std::move(callback_);
+        }
+        ready(callback);
+        return true;
+    }
+
+    bool set_exception(std::exception_ptr e)
+    {
+        Task callback;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (is_ready_)
+                return false;
+            error_ = e;
+            is_ready_ = true;
+            callback = std::move(callback_);
+        }
+        ready(callback);
+        return true;
+    }
+
+    void on_ready(Task callback)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!is_ready_) {
+                callback_ = std::move(callback);
+                return;
+            }
+        }
+        callback();
+    }
+
+    bool is_ready() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return is_ready_;
+    }
+
+    void wait() { cond_.wait(); }
+
+    template<class Rep, class Period>
+    std::future_status wait_for(std::chrono::duration<Rep, Period> const &t)
+    {
+        return (cond_.wait(t) == std::cv_status::no_timeout
+                ? std::future_status::ready
+                : std::future_status::timeout);
+    }
+
+    T get()
+    {
+        wait();
+        if (error_)
+            std::rethrow_exception(error_);
+        return value_.take();
+    }
+
+    /// call fn with the value of the ready state
+    template <typename FnT>
+    auto apply(FnT &fn) -> decltype(std::declval<Storage<T>&>().apply(fn))
+    {
+        if (error_)
+            std::rethrow_exception(error_);
+        return value_.apply(fn);
+    }
+
+private:
+    void ready(Task &callback)
+    {
+        cond_.done();
+        if (callback)
+            callback();
+    }
+
+    mutable std::mutex mutex_;
+    bool is_ready_;
+    Storage<T> value_;
+    std::exception_ptr error_;
+    Task callback_;
+    BasicCondition cond_;
+};
+
+template <typename FnT, typename T>
+struct ResultOf
+{
+    typedef decltype(std::declval<FnT&>()(std::declval<T>())) type;
+};
+
+template <typename FnT>
+struct ResultOf<FnT, void>
+{
+    typedef decltype(std::declval<FnT&>()()) type;
+};
+
+/// set promise value to the result of fn or to the thrown exception
+template <typename R>
+struct Fulfill
+{
+    template <typename FnT>
+    static void apply(Promise<R> &dst, FnT const &fn)
+    {
+        try {
+            dst.set_value(fn());
+        } catch (...) {
+            dst.set_exception(std::current_exception());
+        }
+    }
+};
+
+template <>
+struct Fulfill<void>
+{
+    template <typename FnT>
+    static void apply(Promise<void> &dst, FnT const &fn);
+};
+
+template <typename T, typename R, typename FnT>
+struct Continuation
+{
+    void operator ()()
+    {
+        auto &src = *src_;
+        auto &fn = fn_;
+        Fulfill<R>::apply(dst_, [&src, &fn]() { return src.apply(fn); });
+    }
+
+    std::shared_ptr<State<T> > src_;
+    Promise<R> dst_;
+    FnT fn_;
+};
+
+template <typename T, typename R, typename FnT, typename ExecutorT>
+struct Schedule
+{
+    /// if executor does not accept the task the promise is broken
+    void operator ()()
+    {
+        executor_->enqueue(Task(std::move(continuation_)));
+    }
+
+    ExecutorT *executor_;
+    Continuation<T, R, FnT> continuation_;
+};
+
+template <typename T> struct AnyResult
+{
+    typedef std::pair<size_t, T> type;
+};
+
+template <> struct AnyResult<void>
+{
+    typedef size_t type;
+};
+
+template <typename T> class AllCollector;
+template <typename T> class AnyCollector;
+
+} // detail
+
+/// promise/future pair carries value or exception, continuations are
+/// executed by the TaskQueue, ThreadPool or any other executor
+/// providing enqueue(cor::Task)
+template <typename T>
+class Promise
+{
+public:
+    Promise()
+        : state_(std::make_shared<detail::State<T> >())
+        , is_retrieved_(false)
+    {}
+
+    Promise(Promise &&from) noexcept
+        : state_(std::move(from.state_))
+        , is_retrieved_(from.is_retrieved_)
+    {}
+
+    Promise& operator =(Promise &&from)
+    {
+        if (this != &from) {
+            release();
+            state_ = std::move(from.state_);
+            is_retrieved_ = from.is_retrieved_;
+        }
+        return *this;
+    }
+
+    /// future gets broken_promise error if value is not set
+    ~Promise() { release(); }
+
+    Future<T> get_future()
+    {
+        if (!state_)
+            throw std::future_error(std::future_errc::no_state);
+        if (is_retrieved_)
+            throw std::future_error
+                (std::future_errc::future_already_retrieved);
+        is_retrieved_ = true;
+        return Future<T>(state_);
+    }
+
+    template <typename... Args>
+    void set_value(Args&&... args)
+    {
+        if (!state().set_value(std::forward<Args>(args)...))
+            throw std::future_error
+                (std::future_errc::promise_already_satisfied);
+    }
+
+    void set_exception(std::exception_ptr e)
+    {
+        if (!state().set_exception(e))
+            throw std::future_error
+                (std::future_errc::promise_already_satisfied);
+    }
+
+private:
+    Promise(Promise const &);
+    Promise& operator =(Promise const &);
+
+    detail::State<T> &state()
+    {
+        if (!state_)
+            throw std::future_error(std::future_errc::no_state);
+        return *state_;
+    }
+
+    void release()
+    {
+        if (state_ && !state_->is_ready())
+            state_->set_exception(std::make_exception_ptr
+                                  (std::future_error
+                                   (std::future_errc::broken_promise)));
+        state_.reset();
+    }
+
+    std::shared_ptr<detail::State<T> > state_;
+    bool is_retrieved_;
+};
+
+/// get() and then() are consuming the future
+template <typename T>
+class Future
+{
+public:
+    Future() {}
+    Future(Future &&from) : state_(std::move(from.state_)) {}
+    Future& operator =(Future &&from)
+    {
+        state_ = std::move(from.state_);
+        return *this;
+    }
+
+    bool valid() const { return !!state_; }
+    bool is_ready() const { return state().is_ready(); }
+    void wait() const { state().wait(); }
+
+    template<class Rep, class Period>
+    std::future_status wait_for
+    (std::chrono::duration<Rep, Period> const &timeout) const
+    {
+        return state().wait_for(timeout);
+    }
+
+    T get()
+    {
+        auto s = take();
+        return s->get();
+    }
+
+    /// fn is called with the value in the executor thread, if the
+    /// future has an exception it is passed to the returned future
+    /// without calling fn
+    template <typename ExecutorT, typename FnT>
+    Future<typename detail::ResultOf<FnT, T>::type>
+    then(ExecutorT &executor, FnT fn)
+    {
+        typedef typename detail::ResultOf<FnT, T>::type result_type;
+        auto s = take();
+        Promise<result_type> dst;
+        auto res = dst.get_future();
+        s->on_ready(detail::Schedule<T, result_type, FnT, ExecutorT>{
+                &executor, {s, std::move(dst), std::move(fn)}
+            });
+        return res;
+    }
+
+private:
+    Future(Future const &);
+    Future& operator =(Future const &);
+
+    template <typename> friend class Promise;
+    template <typename> friend class detail::AllCollector;
+    template <typename> friend class detail::AnyCollector;
+
+    explicit Future(std::shared_ptr<detail::State<T> > const &s) : state_(s) {}
+
+    detail::State<T> &state() const
+    {
+        if (!state_)
+            throw std::future_error(std::future_errc::no_state);
+        return *state_;
+    }
+
+    std::shared_ptr<detail::State<T> > take()
+    {
+        state();
+        return std::move(state_);
+    }
+
+    std::shared_ptr<detail::State<T> > state_;
+};
+
+template <typename FnT>
+void detail::Fulfill<void>::apply(Promise<void> &dst, FnT const &fn)
+{
+    try {
+        fn();
+        dst.set_value();
+    } catch (...) {
+        dst.set_exception(std::current_exception());
+    }
+}
+
+template <typename T>
+Future<typename std::decay<T>::type> make_ready_future(T &&value)
+{
+    Promise<typename std::decay<T>::type> p;
+    p.set_value(std::forward<T>(value));
+    return p.get_future();
+}
+
+inline Future<void> make_ready_future()
+{
+    Promise<void> p;
+    p.set_value();
+    return p.get_future();
+}
+
+namespace detail
+{
+
+template <typename T>
+struct AllValues
+{
+    typedef std::vector<T> type;
+
+    static void set(Promise<type> &dst
+                    , std::vector<std::shared_ptr<State<T> > > &src)
+    {
+        type res;
+        res.reserve(src.size());
+        for (auto &s : src)
+            res.push_back(s->get());
+        dst.set_value(std::move(res));
+    }
+};
+
+template <>
+struct AllValues<void>
+{
+    typedef void type;
+
+    static void set(Promise<type> &dst
+                    , std::vector<std::shared_ptr<State<void> > > &src)
+    {
+        for (auto &s : src)
+            s->get();
+        dst.set_value();
+    }
+};
+
+template <typename T>
+class AllCollector
+{
+public:
+    typedef typename AllValues<T>::type result_type;
+
+    static Future<result_type> collect(std::vector<Future<T> > &&src)
+    {
+        auto self = std::make_shared<AllCollector>();
+        auto res = self->dst_.get_future();
+        self->left_ = src.size();
+        for (auto &f : src)
+            self->src_.push_back(f.take());
+        if (src.empty())
+            self->done();
+        // callbacks can be called immediately, so self->src_ is not
+        // used to iterate
+        auto states = self->src_;
+        for (auto &s : states)
+            s->on_ready([self]() {
+                    if (!--self->left_)
+                        self->done();
+                });
+        return res;
+    }
+
+private:
+    void done()
+    {
+        try {
+            AllValues<T>::set(dst_, src_);
+        } catch (...) {
+            dst_.set_exception(std::current_exception());
+        }
+    }
+
+    std::vector<std::shared_ptr<State<T> > > src_;
+    std::atomic<size_t> left_;
+    Promise<result_type> dst_;
+};
+
+template <typename T>
+struct AnyValue
+{
+    static void set(Promise<std::pair<size_t, T> > &dst, size_t pos
+                    , State<T> &src)
+    {
+        dst.set_value(std::make_pair(pos, src.get()));
+    }
+};
+
+template <>
+struct AnyValue<void>
+{
+    static void set(Promise<size_t> &dst, size_t pos, State<void> &src)
+    {
+        src.get();
+        dst.set_value(pos);
+    }
+};
+
+template <typename T>
+class AnyCollector
+{
+public:
+    typedef typename AnyResult<T>::type result_type;
+
+    AnyCollector() : is_done_(false) {}
+
+    static Future<result_type> collect(std::vector<Future<T> > &&src)
+    {
+        if (src.empty())
+            throw std::invalid_argument("when_any: no futures");
+
+        auto self = std::make_shared<AnyCollector>();
+        auto res = self->dst_.get_future();
+        for (size_t i = 0; i < src.size(); ++i) {
+            auto s = src[i].take();
+            auto p = s.get();
+            p->on_ready([self, i, s]() { self->done(i, *s); });
+        }
+        return res;
+    }
+
+private:
+    void done(size_t pos, State<T> &src)
+    {
+        if (is_done_.exchange(true))
+            return;
+        try {
+            AnyValue<T>::set(dst_, pos, src);
+        } catch (...) {
+            dst_.set_exception(std::current_exception());
+        }
+    }
+
+    std::atomic<bool> is_done_;
+    Promise<result_type> dst_;
+};
+
+} // detail
+
+/// ready when all futures are ready, values are in the same order
+/// as futures. If any future has an exception the first one is set
+template <typename T>
+Future<typename detail::AllValues<T>::type>
+when_all(std::vector<Future<T> > futures)
+{
+    return detail::AllCollector<T>::collect(std::move(futures));
+}
+
+/// ready when the first future is ready, holds its position and value
+template <typename T>
+Future<typename detail::AnyResult<T>::type>
+when_any(std::vector<Future<T> > futures)
+{
+    return detail::AnyCollector<T>::collect(std::move(futures));
+}
+
+} // async
+} // cor
+
+#endif // _COR_ASYNC_HPP_
@@ -0,0 +1,236 @@
+#ifndef _COR_CORO_HPP_
+#define _COR_CORO_HPP_
+
+// library itself is built as C++11, awaitables are available only
+// for C++20 users
+#if !defined(__cpp_impl_coroutine)
+#error "cor/coro.hpp requires C++20 coroutines support"
+#endif
+
+#include <cor/mt.hpp>
+#include <cor/util.hpp>
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <poll.h>
+
+namespace cor
+{
+namespace coro
+{
+
+/// task resuming the coroutine, it holds only the coroutine handle,
+/// so it fits into the Task inline buffer and await does not
+/// allocate memory
+///
+/// If the task is destroyed w/o execution (e.g. executor is
+/// destroyed with pending tasks or timers), coroutine is never
+/// resumed and its frame is not destroyed. Frame of the Detached
+/// coroutine is leaked then, coroutine owned by the caller should be
+/// used if executor can be destroyed before resuming it
+struct Resume
+{
+    void operator ()() const { handle.resume(); }
+
+    std::coroutine_handle<> handle;
+};
+
+/// fire-and-forget coroutine, it is started immediately and its frame
+/// is destroyed on completion
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/// co_await returns false and coroutine continues in the current
+/// thread if executor does not accept the task (e.g. it is stopped)
+template <typename ExecutorT>
+class Schedule
+{
+public:
+    Schedule(ExecutorT &executor) : executor_(executor), is_queued_(false) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        // coroutine can be resumed before enqueue() returns, so this
+        // object is not touched if task is queued
+        is_queued_ = true;
+        if (executor_.enqueue(Task(Resume{h})))
+            return true;
+        is_queued_ = false;
+        return false;
+    }
+
+    bool await_resume() const noexcept { return is_queued_; }
+
+private:
+    ExecutorT &executor_;
+    bool is_queued_;
+};
+
+template <typename ExecutorT>
+Schedule<ExecutorT> schedule(ExecutorT &executor)
+{
+    return Schedule<ExecutorT>(executor);
+}
+
+/// coroutine is resumed in the queue thread after timeout. co_await
+/// returns false and coroutine continues in the current thread if
+/// queue is stopped
+template <class Rep, class Period>
+class Sleep
+{
+public:
+    Sleep(TaskQueue &queue, std::chrono::duration<Rep, Period> timeout)
+        : queue_(queue), timeout_(timeout), is_queued_(false)
+    {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        is_queued_ = true;
+        if (queue_.enqueue_after(timeout_, Resume{h}).is_valid())
+            return true;
+        is_queued_ = false;
+        return false;
+    }
+
+    bool await_resume() const noexcept { return is_queued_; }
+
+private:
+    TaskQueue &queue_;
+    std::chrono::duration<Rep, Period> timeout_;
+    bool is_queued_;
+};
+
+template <class Rep, class Period>
+Sleep<Rep, Period> sleep_for
+(TaskQueue &queue, std::chrono::duration<Rep, Period> timeout)
+{
+    return Sleep<Rep, Period>(queue, timeout);
+}
+
+/// coroutine is resumed when fd is ready. Reactor should provide
+/// bool watch_once(int fd, short poll_events, cor::Task) calling
+/// the task once in the reactor thread
+template <typename ReactorT>
+class FdReady
+{
+public:
+    FdReady(ReactorT &reactor, int fd, short events)
+        : reactor_(reactor), fd_(fd), events_(events), is_watched_(false)
+    {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        is_watched_ = true;
+        if (reactor_.watch_once(fd_, events_, Task(Resume{h})))
+            return true;
+        is_watched_ = false;
+        return false;
+    }
+
+    bool await_resume() const noexcept { return is_watched_; }
+
+private:
+    ReactorT &reactor_;
+    int fd_;
+    short events_;
+    bool is_watched_;
+};
+
+template <typename ReactorT>
+FdReady<ReactorT> readable(ReactorT &reactor, int fd)
+{
+    return FdReady<ReactorT>(reactor, fd, POLLIN);
+}
+
+template <typename ReactorT>
+FdReady<ReactorT> readable(ReactorT &reactor, FdHandle const &h)
+{
+    return readable(reactor, h.value());
+}
+
+template <typename ReactorT>
+FdReady<ReactorT> writable(ReactorT &reactor, int fd)
+{
+    return FdReady<ReactorT>(reactor, fd, POLLOUT);
+}
+
+template <typename ReactorT>
+FdReady<ReactorT> writable(ReactorT &reactor, FdHandle const &h)
+{
+    return writable(reactor, h.value());
+}
+
+/// co_await returns handler result: transferred bytes or -errno.
+/// Engine should provide read/write(fd, buf, len, handler(ssize_t)),
+/// e.g. cor::IoEngine. Handler captures only this pointer, so it is
+/// stored by std::function without allocation
+template <typename EngineT, bool IsWrite>
+class Io
+{
+public:
+    typedef typename std::conditional
+    <IsWrite, void const*, void*>::type buffer_type;
+
+    Io(EngineT &engine, int fd, buffer_type buf, size_t len)
+        : engine_(engine), fd_(fd), buf_(buf), len_(len), res_(0)
+    {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        handle_ = h;
+        auto on_complete = [this](ssize_t res) {
+            res_ = res;
+            handle_.resume();
+        };
+        if (IsWrite)
+            engine_.write(fd_, buf_, len_, on_complete);
+        else
+            engine_.read(fd_, const_cast<void*>(buf_), len_, on_complete);
+    }
+
+    ssize_t await_resume() const noexcept { return res_; }
+
+private:
+    EngineT &engine_;
+    int fd_;
+    buffer_type buf_;
+    size_t len_;
+    ssize_t res_;
+    std::coroutine_handle<> handle_;
+};
+
+template <typename EngineT>
+Io<EngineT, false> read(EngineT &engine, int fd, void *buf, size_t len)
+{
+    return Io<EngineT, false>(engine, fd, buf, len);
+}
+
+template <typename EngineT>
+Io<EngineT, true> write
+(EngineT &engine, int fd, void const *buf, size_t len)
+{
+    return Io<EngineT, true>(engine, fd, buf, len);
+}
+
+} // coro
+} // cor
+
+#endif // _COR_CORO_HPP_
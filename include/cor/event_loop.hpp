@@ -0,0 +1,110 @@
+#ifndef _COR_EVENT_LOOP_HPP_
+#define _COR_EVENT_LOOP_HPP_
+
+#include <cor/mt.hpp>
+#include <cor/pipe.hpp>
+#include <cor/util.hpp>
+
+#include <functional>
+#include <memory>
+#include <sys/epoll.h>
+
+namespace cor
+{
+
+inline int fd_of(int fd) { return fd; }
+inline int fd_of(FdHandle const &h) { return h.value(); }
+/// read end of the pipe
+inline int fd_of(Pipe const &p) { return p.first(); }
+
+/// inotify::Handle, udevpp::Monitor and other sources providing fd()
+template <typename T>
+auto fd_of(T const &src) -> decltype(src.fd())
+{
+    return src.fd();
+}
+
+/// epoll-based loop multiplexing many fd sources in a single thread
+///
+/// Sources are registered with epoll events (EPOLLIN etc.), handlers
+/// are called from the thread executing run()/run_once() or, if the
+/// queue is passed on registration, from the TaskQueue thread
+///
+/// Registration, removal and enqueue() can be done from any thread,
+/// including handlers. Handler is not called after remove() returns,
+/// unless remove() is called concurrently with the loop dispatching
+/// this source. Exceptions thrown by handlers and tasks are logged
+/// and are not propagated to the loop
+class EventLoopImpl;
+class EventLoop
+{
+public:
+    enum Mode { Level, Edge };
+    /// receives epoll events reported for the source
+    typedef std::function<void (uint32_t)> handler_type;
+
+    EventLoop();
+    EventLoop(EventLoop &&);
+    virtual ~EventLoop();
+
+    void add(int fd, uint32_t events, handler_type, Mode = Level);
+    /// source is disarmed until handler is executed by the queue,
+    /// so level-triggered source does not flood the queue
+    void add(int fd, uint32_t events, TaskQueue &, handler_type);
+    void modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    template <typename SourceT>
+    void add(SourceT const &src, uint32_t events, handler_type handler
+             , Mode mode = Level)
+    {
+        add(fd_of(src), events, std::move(handler), mode);
+    }
+
+    template <typename SourceT>
+    void add(SourceT const &src, uint32_t events, TaskQueue &queue
+             , handler_type handler)
+    {
+        add(fd_of(src), events, queue, std::move(handler));
+    }
+
+    template <typename SourceT>
+    void remove(SourceT const &src)
+    {
+        remove(fd_of(src));
+    }
+
+    /// call task once when fd is ready for poll_events (POLLIN,
+    /// POLLOUT), fd should not be registered in the loop. Returns
+    /// false if the loop is stopped or fd can't be watched
+    bool watch_once(int fd, short poll_events, Task);
+
+    /// execute task in the loop thread
+    bool enqueue(Task);
+
+    template <typename T>
+    bool enqueue(T fn)
+    {
+        return enqueue(Task{std::move(fn)});
+    }
+
+    /// dispatch ready events waiting up to timeout_msec (-1 means
+    /// forever), returns number of dispatched events and tasks
+    size_t run_once(int timeout_msec = -1);
+    /// dispatch events until stop() is called
+    void run();
+    /// can be called from any thread, also wakes up the loop
+    void stop();
+    bool is_stopped() const;
+    void wakeup();
+    /// epoll fd, readable when loop has events to dispatch
+    int fd() const;
+
+private:
+    // tasks dispatched to TaskQueue keep weak reference to the loop
+    std::shared_ptr<EventLoopImpl> impl_;
+};
+
+}
+
+#endif // _COR_EVENT_LOOP_HPP_
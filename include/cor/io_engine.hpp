@@ -0,0 +1,87 @@
+#ifndef _COR_IO_ENGINE_HPP_
+#define _COR_IO_ENGINE_HPP_
+
+#include <cor/util.hpp>
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace cor
+{
+
+/// asynchronous reads and writes with batched submission: io_uring
+/// based with the fallback to epoll readiness notifications
+///
+/// Operations are queued and submitted at once by submit() or
+/// run_once(), completion handlers are called from run_once() and
+/// receive the number of transferred bytes or -errno
+///
+/// Engine is not thread-safe, it should be used from a single thread
+/// (e.g. EventLoop or TaskQueue one). Buffers should stay valid until
+/// completion
+///
+/// Epoll backend executes reads and writes on fd one by one when fd
+/// is ready for them, reads and writes are not blocking each
+/// other. Operations on regular files are executed synchronously
+class IoEngineImpl;
+class IoEngine
+{
+public:
+    enum Backend { Auto, Uring, Epoll };
+    typedef std::function<void (ssize_t)> handler_type;
+
+    IoEngine(unsigned entries = 256, Backend = Auto);
+    IoEngine(IoEngine &&);
+    virtual ~IoEngine();
+
+    Backend backend() const;
+
+    /// offset -1 means current file position
+    void read(int fd, void *buf, size_t len, handler_type, off_t offset = -1);
+    void write(int fd, void const *buf, size_t len, handler_type
+               , off_t offset = -1);
+
+    void read(FdHandle const &h, void *buf, size_t len, handler_type handler
+              , off_t offset = -1)
+    {
+        read(h.value(), buf, len, std::move(handler), offset);
+    }
+
+    void write(FdHandle const &h, void const *buf, size_t len
+               , handler_type handler, off_t offset = -1)
+    {
+        write(h.value(), buf, len, std::move(handler), offset);
+    }
+
+    /// buffers are pinned by the kernel once, *_fixed operations
+    /// should use memory inside the buffer with passed index.
+    /// Replaces previously registered buffers
+    void register_buffers(std::vector<iovec> const &);
+    void read_fixed(int fd, unsigned index, void *buf, size_t len
+                    , handler_type, off_t offset = -1);
+    void write_fixed(int fd, unsigned index, void const *buf, size_t len
+                     , handler_type, off_t offset = -1);
+
+    /// returns number of submitted operations
+    size_t submit();
+    /// submit queued operations and wait for completions up to
+    /// timeout_msec (-1 means forever), returns number of called
+    /// handlers
+    size_t run_once(int timeout_msec = -1);
+    /// number of queued or submitted but not completed operations
+    size_t pending() const;
+
+    /// fd becomes readable when there are completions, so the engine
+    /// can be driven by EventLoop calling run_once(0)
+    int fd() const;
+
+private:
+    std::unique_ptr<IoEngineImpl> impl_;
+};
+
+}
+
+#endif // _COR_IO_ENGINE_HPP_
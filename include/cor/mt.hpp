@@ -6,6 +6,15 @@
 #include <thread>
 #include <future>
 #include <condition_variable>
+#include <type_traits>
+#include <new>
+#include <vector>
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <pthread.h>
+#include <sched.h>
 
 namespace cor {
 
@@ -56,6 +65,111 @@ private:
     mutable std::mutex l_;
 };
 
+/// reader/writer lock, readers are not blocking each other. Writer
+/// preferring mode blocks new readers while writer is waiting
+class RWMutex
+{
+public:
+    enum Policy { PreferReaders, PreferWriters };
+
+    explicit RWMutex(Policy = PreferReaders);
+    virtual ~RWMutex();
+
+    class WLock
+    {
+    public:
+        WLock(RWMutex const &m);
+        WLock(WLock &&from);
+        ~WLock() { unlock(); }
+
+        void unlock();
+    private:
+        WLock(WLock const &);
+        WLock& operator =(WLock const &);
+
+        RWMutex const *m_;
+    };
+
+    class RLock
+    {
+    public:
+        RLock(RWMutex const &m);
+        RLock(RLock &&from);
+        ~RLock() { unlock(); }
+
+        void unlock();
+    private:
+        RLock(RLock const &);
+        RLock& operator =(RLock const &);
+
+        RWMutex const *m_;
+    };
+
+private:
+    RWMutex(RWMutex const &);
+    RWMutex& operator =(RWMutex const &);
+
+    mutable pthread_rwlock_t l_;
+};
+
+/// reader/writer lock for the read-mostly data accessed by many
+/// threads. Readers are only touching the counter of the current CPU,
+/// writers are serialized, they are waiting for all counters to
+/// drain. Waiting writer blocks new readers
+class ScalableRWMutex
+{
+public:
+    ScalableRWMutex();
+    virtual ~ScalableRWMutex();
+
+    class WLock
+    {
+    public:
+        WLock(ScalableRWMutex const &m);
+        WLock(WLock &&from);
+        ~WLock() { unlock(); }
+
+        void unlock();
+    private:
+        WLock(WLock const &);
+        WLock& operator =(WLock const &);
+
+        ScalableRWMutex const *m_;
+    };
+
+    class RLock
+    {
+    public:
+        RLock(ScalableRWMutex const &m);
+        RLock(RLock &&from);
+        ~RLock() { unlock(); }
+
+        void unlock();
+    private:
+        RLock(RLock const &);
+        RLock& operator =(RLock const &);
+
+        ScalableRWMutex const *m_;
+        std::atomic<long> *counter_;
+    };
+
+private:
+    ScalableRWMutex(ScalableRWMutex const &);
+    ScalableRWMutex& operator =(ScalableRWMutex const &);
+
+    // counters are put into separate cache lines, array is allocated
+    // aligned because new does not respect alignment > 16 in C++11
+    struct alignas(64) Counter
+    {
+        Counter() : value(0) {}
+        std::atomic<long> value;
+    };
+
+    Counter *readers_;
+    size_t readers_count_;
+    mutable std::atomic<bool> is_writing_;
+    mutable std::mutex writer_;
+};
 
 struct NoLock
 {
@@ -69,37 +183,52 @@ struct NoLock
     typedef RLock WLock;
 };
 
+/// futex operations on the atomic integer
+namespace futex {
+
+/// wait while word value is equal to expected, returns false on
+/// timeout. Can return spuriously
+bool wait(std::atomic<int> &, int expected);
+bool wait_until(std::atomic<int> &, int expected
+                , std::chrono::steady_clock::time_point);
+void wake(std::atomic<int> &, int count);
+void wake_all(std::atomic<int> &);
+
+}
+
 /// Condition variables are frequently used for a simple pattern with
 /// a single mutex. Class wraps this logic. Object is created by one
-/// who is waiting
+/// who is waiting. It is implemented using futex, done() is a single
+/// atomic operation if nobody is waiting
 class BasicCondition
 {
 public:
-    BasicCondition() : awake_(false) {}
+    BasicCondition() : state_(Waiting) {}
+
+    void wait();
 
     template<class Rep, class Period>
     std::cv_status wait(std::chrono::duration<Rep, Period> const& rel_time)
     {
-        std::unique_lock<std::mutex> lock_(mutex_);
-        return (awake_
-                ? std::cv_status::no_timeout
-                : done_.wait_for(lock_, rel_time));
+        using namespace std::chrono;
+        return wait_until(steady_clock::now()
+                          + duration_cast<steady_clock::duration>(rel_time));
     }
 
     void done()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        awake_ = true;
-        done_.notify_one();
+        if (state_.exchange(Done) == Sleeping)
+            futex::wake_all(state_);
     }
 
 private:
     BasicCondition(BasicCondition const&);
     BasicCondition& operator =(BasicCondition const&);
 
-    std::mutex mutex_;
-    std::condition_variable done_;
-    bool awake_;
+    std::cv_status wait_until(std::chrono::steady_clock::time_point);
+
+    enum State { Waiting, Sleeping, Done };
+    std::atomic<int> state_;
 };
 
 
@@ -107,13 +236,45 @@ private:
  * universal future implementation can be used with different kind of
  * threads (not only c++11 but also e.g. with Qt etc.)
  *
- * @todo ability to return value of executed function
- * @todo remove it, use std::promise
+ * Condition is shared with wrappers because they can outlive the
+ * Future, it is allocated when the first wrapper is created
+ *
+ * cor::async::Promise from cor/async.hpp should be used to get
+ * the value of executed function
  */
 class Future
 {
+    typedef std::shared_ptr<BasicCondition> cond_ptr;
+
+    struct Nop
+    {
+        void operator ()() const {}
+    };
+
 public:
-    Future() : cond(new BasicCondition()) {}
+    Future() {}
+
+    template <typename BeforeT, typename AfterT>
+    struct Wrapper
+    {
+        void operator ()()
+        {
+            before();
+            cond->done();
+            after();
+        }
+
+        cond_ptr cond;
+        BeforeT before;
+        AfterT after;
+    };
+
+    struct Waker
+    {
+        void operator ()() const { cond->done(); }
+
+        cond_ptr cond;
+    };
 
     /**
      * wrap passed function to be executed as a future. So, Future
@@ -123,40 +284,41 @@ public:
      * @return wrapper function to be passed to another thread
      */
     template <typename ExecutableT>
-    std::function<void()> wrap(ExecutableT fn)
+    Wrapper<ExecutableT, Nop> wrap(ExecutableT fn)
     {
-        return wrap(fn, [](){});
+        return wrap(std::move(fn), Nop());
     }
 
     template <typename BeforeT, typename AfterT>
-    std::function<void()> wrap(BeforeT before, AfterT after)
+    Wrapper<BeforeT, AfterT> wrap(BeforeT before, AfterT after)
     {
-        auto c = cond;
-        return [c, before, after]() {
-            before();
-            c->done();
-            after();
+        return Wrapper<BeforeT, AfterT>{
+            condition(), std::move(before), std::move(after)
         };
     }
 
-    std::function<void()> waker()
+    Waker waker()
     {
-        auto c = cond;
-        return [c]() {
-            c->done();
-        };
+        return Waker{condition()};
     }
 
     template<class Rep, class Period>
     std::cv_status wait(std::chrono::duration<Rep, Period> const& rel_time) {
-        return cond->wait(rel_time);
+        return condition()->wait(rel_time);
     }
 
 private:
     Future(Future const&);
     Future& operator =(Future const&);
 
-    std::shared_ptr<BasicCondition> cond;
+    cond_ptr const& condition()
+    {
+        if (!cond)
+            cond = std::make_shared<BasicCondition>();
+        return cond;
+    }
+
+    cond_ptr cond;
 };
 
 // gcc 4.6 future::wait_for() returns bool instead of future_status
@@ -195,10 +357,13 @@ std::future_status wait_for
     return impl.template wait_for<>(future, timeout);
 }
 
+/// counter reaching zero releases all waiters. Futex word keeps the
+/// counter and the flag set by waiters, so up() and down() are single
+/// atomic operations if nobody is waiting
 class Completion
 {
 public:
-    Completion() : counter_(0) {}
+    Completion() : state_(0) {}
 
     void up();
     void down();
@@ -208,46 +373,453 @@ public:
     std::cv_status wait_for(const std::chrono::duration<Rep,Period> &);
 
 private:
-    std::mutex mutex_;
-    std::condition_variable done_;
-    long counter_;
+    Completion(Completion const&);
+    Completion& operator =(Completion const&);
+
+    bool wait_until(std::chrono::steady_clock::time_point const *);
+
+    enum { has_waiters = 1, counter_step = 2 };
+    std::atomic<int> state_;
 };
 
 template<class Rep, class Period>
 std::cv_status Completion::wait_for(const std::chrono::duration<Rep,Period> &timeout)
 {
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (!counter_)
-        return std::cv_status::no_timeout;
+    using namespace std::chrono;
+    auto deadline = steady_clock::now()
+        + duration_cast<steady_clock::duration>(timeout);
+    return wait_until(&deadline)
+        ? std::cv_status::no_timeout
+        : std::cv_status::timeout;
+}
+
+
+/// move-only void() callable. Callables small enough to fit into the
+/// inline buffer are stored there without heap allocation
+class Task
+{
+    typedef std::aligned_storage<6 * sizeof(void*), alignof(void*)>::type
+    storage_type;
+
+    template <typename T>
+    struct IsInline : std::integral_constant
+    <bool, sizeof(T) <= sizeof(storage_type)
+     && alignof(T) <= alignof(storage_type)
+     && std::is_nothrow_move_constructible<T>::value> {};
+
+public:
+    Task() : ops_(nullptr) {}
+
+    template <typename FnT, typename = typename std::enable_if
+              <!std::is_same<typename std::decay<FnT>::type, Task>::value
+               >::type>
+    Task(FnT &&fn)
+        : ops_(&Ops<typename std::decay<FnT>::type>::value)
+    {
+        typedef typename std::decay<FnT>::type fn_type;
+        create<fn_type>(std::forward<FnT>(fn), IsInline<fn_type>());
+    }
+
+    Task(Task &&from) : ops_(from.ops_)
+    {
+        if (ops_) {
+            ops_->move(&storage_, &from.storage_);
+            from.ops_ = nullptr;
+        }
+    }
+
+    Task& operator =(Task &&from)
+    {
+        if (this != &from) {
+            reset();
+            if (from.ops_) {
+                from.ops_->move(&storage_, &from.storage_);
+                ops_ = from.ops_;
+                from.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    ~Task() { reset(); }
+
+    void operator ()() { ops_->call(&storage_); }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+    void reset()
+    {
+        if (ops_) {
+            ops_->destroy(&storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    Task(Task const &);
+    Task& operator =(Task const &);
+
+    struct Vtbl
+    {
+        void (*call)(void*);
+        void (*move)(void*, void*);
+        void (*destroy)(void*);
+    };
+
+    template <typename T, bool = IsInline<T>::value>
+    struct Ops
+    {
+        static void call(void *p) { (*static_cast<T*>(p))(); }
+        static void move(void *dst, void *src)
+        {
+            auto from = static_cast<T*>(src);
+            new (dst) T(std::move(*from));
+            from->~T();
+        }
+        static void destroy(void *p) { static_cast<T*>(p)->~T(); }
+        static Vtbl const value;
+    };
+
+    template <typename T>
+    struct Ops<T, false>
+    {
+        static void call(void *p) { (**static_cast<T**>(p))(); }
+        static void move(void *dst, void *src)
+        {
+            *static_cast<T**>(dst) = *static_cast<T**>(src);
+        }
+        static void destroy(void *p) { delete *static_cast<T**>(p); }
+        static Vtbl const value;
+    };
+
+    template <typename T, typename FnT>
+    void create(FnT &&fn, std::true_type)
+    {
+        new (&storage_) T(std::forward<FnT>(fn));
+    }
+
+    template <typename T, typename FnT>
+    void create(FnT &&fn, std::false_type)
+    {
+        *reinterpret_cast<T**>(&storage_) = new T(std::forward<FnT>(fn));
+    }
+
+    storage_type storage_;
+    Vtbl const *ops_;
+};
+
+template <typename T, bool IsInlineV>
+Task::Vtbl const Task::Ops<T, IsInlineV>::value = {
+    &Task::Ops<T, IsInlineV>::call,
+    &Task::Ops<T, IsInlineV>::move,
+    &Task::Ops<T, IsInlineV>::destroy
+};
+
+template <typename T>
+Task::Vtbl const Task::Ops<T, false>::value = {
+    &Task::Ops<T, false>::call,
+    &Task::Ops<T, false>::move,
+    &Task::Ops<T, false>::destroy
+};
+
+/// tasks to be enqueued into the TaskQueue at once
+struct TaskNode;
+class TaskBatch
+{
+public:
+    TaskBatch() : head_(nullptr), tail_(nullptr), size_(0) {}
+    TaskBatch(TaskBatch &&);
+    ~TaskBatch();
+
+    void push(Task);
+    size_t size() const { return size_; }
+    bool empty() const { return !size_; }
+
+private:
+    TaskBatch(TaskBatch const &);
+    TaskBatch& operator =(TaskBatch const &);
+
+    friend class TaskQueueImpl;
+    // tasks are linked in the reversed order
+    TaskNode *head_;
+    TaskNode *tail_;
+    size_t size_;
+};
+
+/// handle of the task scheduled for the later execution
+struct TimerEntry;
+class Timer
+{
+public:
+    Timer() {}
+
+    /// returns false if timer is already fired or cancelled
+    bool cancel();
+    bool is_active() const;
+    /// false if task was not scheduled
+    bool is_valid() const { return !!entry_; }
+
+private:
+    friend class TaskQueueImpl;
+    Timer(std::shared_ptr<TimerEntry> const &entry) : entry_(entry) {}
+
+    std::shared_ptr<TimerEntry> entry_;
+};
+
+class CpuSet
+{
+public:
+    CpuSet() { CPU_ZERO(&set_); }
+    CpuSet(std::initializer_list<unsigned> cpus) : CpuSet()
+    {
+        for (auto cpu : cpus)
+            add(cpu);
+    }
+
+    /// CPUs the calling thread is allowed to run on
+    static CpuSet allowed();
+
+    void add(unsigned cpu) { CPU_SET(cpu, &set_); }
+    bool contains(unsigned cpu) const { return CPU_ISSET(cpu, &set_); }
+    size_t size() const { return CPU_COUNT(&set_); }
+    bool empty() const { return !size(); }
+    std::vector<unsigned> cpus() const;
+
+    CpuSet operator &(CpuSet const &other) const
+    {
+        CpuSet res;
+        CPU_AND(&res.set_, &set_, &other.set_);
+        return res;
+    }
+
+    bool operator ==(CpuSet const &other) const
+    {
+        return CPU_EQUAL(&set_, &other.set_);
+    }
+
+    cpu_set_t const & native() const { return set_; }
+
+private:
+    cpu_set_t set_;
+};
+
+/// throw CError on failure
+void set_affinity(CpuSet const &);
+CpuSet get_affinity();
+
+namespace numa
+{
+
+/// 1 if there is no NUMA information
+size_t nodes_count();
+/// CPUs of the NUMA node
+CpuSet node_cpus(unsigned node);
 
-    return done_.wait_for(lock, timeout);
 }
 
+struct HistogramSnapshot
+{
+    HistogramSnapshot() : count(0), sum(0), max(0) { buckets.fill(0); }
+
+    /// p is in [0, 100], returns upper bound of the bucket
+    uint64_t percentile(double p) const;
+    double mean() const { return count ? (double)sum / count : 0; }
 
+    std::array<uint64_t, 256> buckets;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/// lock-free histogram with log-linear buckets: 4 buckets per power
+/// of 2, so relative error is below 25%
+class Histogram
+{
+public:
+    enum { sub_bits = 2, buckets_count = 64 << sub_bits };
+
+    Histogram() { reset(); }
+
+    void record(uint64_t v)
+    {
+        buckets_[index(v)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(v, std::memory_order_relaxed);
+        auto max = max_.load(std::memory_order_relaxed);
+        while (v > max && !max_.compare_exchange_weak
+               (max, v, std::memory_order_relaxed)) {}
+    }
+
+    HistogramSnapshot snapshot() const;
+    void reset();
+
+    static unsigned index(uint64_t v)
+    {
+        if (v < (1 << sub_bits))
+            return v;
+        unsigned msb = 63 - __builtin_clzll(v);
+        unsigned shift = msb - sub_bits;
+        return ((shift + 1) << sub_bits)
+            + ((v >> shift) & ((1 << sub_bits) - 1));
+    }
+
+    /// max value stored in the bucket
+    static uint64_t upper_bound(unsigned index);
+
+private:
+    Histogram(Histogram const &);
+    Histogram & operator =(Histogram const &);
+
+    std::atomic<uint64_t> buckets_[buckets_count];
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+/// enqueue(Task) is a fire-and-forget path without heap allocation
+/// for small callables, pass std::packaged_task to get a future.
+/// Exceptions thrown by fire-and-forget tasks are logged and dropped
+///
+/// Timers are kept in the hierarchical timer wheel with 1ms
+/// resolution handled by the queue thread
 class TaskQueueImpl;
 class TaskQueue
 {
 public:
     TaskQueue();
+    /// queue thread is pinned to the CPU set
+    explicit TaskQueue(CpuSet const &);
     TaskQueue(TaskQueue&&);
     virtual ~TaskQueue();
 
+    /// lanes are scheduled with weights 8:4:1 if all are busy
+    enum Priority {
+        High, Normal, Low,
+        priorities_count
+    };
+
+    bool enqueue(Task);
+    bool enqueue(Task, Priority);
     bool enqueue(std::packaged_task<void()>);
 
     template <typename T>
     bool enqueue(T fn)
     {
-        return enqueue(std::packaged_task<void()>{std::move(fn)});
+        return enqueue(Task{std::move(fn)});
+    }
+
+    template <typename T>
+    bool enqueue(T fn, Priority priority)
+    {
+        return enqueue(Task{std::move(fn)}, priority);
     }
 
+    /// publish all tasks with a single synchronization and wakeup
+    bool enqueue_bulk(TaskBatch &&, Priority = Normal);
+
+    /// tasks or callables are moved from the range
+    template <typename RangeT>
+    bool enqueue_bulk(RangeT &&range, Priority priority = Normal)
+    {
+        TaskBatch batch;
+        for (auto &fn : range)
+            batch.push(Task{std::move(fn)});
+        return enqueue_bulk(std::move(batch), priority);
+    }
+
+    typedef std::chrono::steady_clock clock_type;
+
+    /// returns inactive timer if queue is stopped
+    Timer enqueue_at(clock_type::time_point, Task);
+
+    template <class Rep, class Period>
+    Timer enqueue_after(std::chrono::duration<Rep, Period> const &timeout
+                        , Task task)
+    {
+        using namespace std::chrono;
+        return enqueue_at(clock_type::now()
+                          + duration_cast<clock_type::duration>(timeout)
+                          , std::move(task));
+    }
+
+    /// task is executed repeatedly with the period until cancelled
+    Timer enqueue_periodic(std::chrono::milliseconds, Task);
+
     void stop();
     void join();
     bool empty() const;
+    /// number of not finished tasks in the priority lane
+    size_t depth(Priority) const;
+
+    struct Stats
+    {
+        /// when snapshot is taken
+        clock_type::time_point time;
+        size_t depth[priorities_count];
+        uint64_t executed;
+        /// time spent by the queue thread waiting for tasks
+        clock_type::duration idle;
+        /// nanoseconds from enqueue to start, task run time
+        HistogramSnapshot latency;
+        HistogramSnapshot run_time;
+
+        /// executed tasks per second since the previous snapshot
+        double throughput(Stats const &prev) const;
+    };
+
+    /// latency, run and idle time are not measured by default to
+    /// avoid reading clock on each enqueue
+    void enable_stats(bool);
+    Stats stats() const;
 
 private:
     std::unique_ptr<TaskQueueImpl> impl_;
 };
 
+/// pool of worker threads with the same interface as TaskQueue. Each
+/// worker has own queue, tasks enqueued from outside of the pool are
+/// distributed between workers, tasks enqueued by a worker are put
+/// into its own queue. Idle workers steal tasks from other
+/// workers, preferring workers of the same NUMA node. Tasks are
+/// executed in parallel, so there is no ordering
+class ThreadPoolImpl;
+class ThreadPool
+{
+public:
+    enum Placement {
+        /// workers are not pinned
+        Unbound,
+        /// worker is pinned to the single CPU from the set, round-robin
+        PinCpus,
+        /// workers are distributed between NUMA nodes round-robin and
+        /// pinned to the node CPUs from the set. Worker queues are
+        /// preallocated by pinned workers, so memory is node-local
+        /// unless the queue overflows
+        SpreadNodes
+    };
+
+    ThreadPool(size_t workers = std::thread::hardware_concurrency());
+    ThreadPool(size_t workers, Placement
+               , CpuSet const &cpus = CpuSet::allowed());
+    ThreadPool(ThreadPool&&);
+    virtual ~ThreadPool();
+
+    bool enqueue(Task);
+    bool enqueue(std::packaged_task<void()>);
+
+    template <typename T>
+    bool enqueue(T fn)
+    {
+        return enqueue(Task{std::move(fn)});
+    }
+
+    void stop();
+    void join();
+    bool empty() const;
+    size_t size() const;
+
+private:
+    std::unique_ptr<ThreadPoolImpl> impl_;
+};
+
 } // cor
 
 #endif // _COR_MT_HPP_
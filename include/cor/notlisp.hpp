@@ -31,14 +31,24 @@
 #include <unordered_map>
 #include <functional>
 #include <algorithm>
-#include <stack>
+#include <array>
+#include <tuple>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
 #include <utility>
+#include <type_traits>
 
 #include <cor/error.hpp>
 #include <cor/sexp.hpp>
+#include <cor/util.hpp>
 
 namespace cor
 {
+
+class ThreadPool;
+
 namespace notlisp
 {
 
@@ -51,6 +61,21 @@ public:
     { }
 };
 
+/// evaluation limit set by Budget is exceeded
+class LimitExceeded : public Error
+{
+public:
+    enum Limit {
+        Steps,
+        Depth,
+        Allocations
+    };
+
+    LimitExceeded(Limit l, unsigned long max);
+
+    Limit limit;
+};
+
 class Expr;
 typedef std::shared_ptr<Expr> expr_ptr;
 typedef std::list<expr_ptr> expr_list_type;
@@ -61,6 +86,11 @@ expr_ptr mk_expr(Args&& ...args)
     return std::make_shared<Expr>(std::forward<Args>(args)...);
 }
 
+/// count of expressions created by the current thread, used by
+/// Profiler and Budget
+extern __thread unsigned long exprs_created
+__attribute__((tls_model("initial-exec")));
+
 class Env;
 typedef std::shared_ptr<Env> env_ptr;
 typedef std::function<expr_ptr (env_ptr, expr_list_type&)> lambda_type;
@@ -98,11 +128,41 @@ public:
         Real
     };
 
-    Expr() : type_(Nil), s_(""), i_(0) {}
-    Expr(std::string const &v, Type t) : type_(t), s_(v) {}
-    Expr(int v) : type_(Integer), s_(""), i_(v) {}
-    Expr(long v) : type_(Integer), s_(""), i_(v) {}
-    Expr(double v) : type_(Real), s_(""), r_(v) {}
+    /// built-in class of the expression object, used to cast
+    /// expressions w/o RTTI. User-defined classes are UserClass
+    enum Class {
+        UserClass,
+        BasicClass,
+        PodClass,
+        SymbolClass,
+        LambdaClass,
+        ListClass,
+        LongVectorClass,
+        RealVectorClass,
+        DictClass
+    };
+
+    Expr() : type_(Nil), class_(UserClass), s_(""), i_(0)
+    {
+        ++exprs_created;
+    }
+    Expr(std::string const &v, Type t)
+        : type_(t), class_(UserClass), s_(v)
+    {
+        ++exprs_created;
+    }
+    Expr(int v) : type_(Integer), class_(UserClass), s_(""), i_(v)
+    {
+        ++exprs_created;
+    }
+    Expr(long v) : type_(Integer), class_(UserClass), s_(""), i_(v)
+    {
+        ++exprs_created;
+    }
+    Expr(double v) : type_(Real), class_(UserClass), s_(""), r_(v)
+    {
+        ++exprs_created;
+    }
 
     virtual ~Expr() {}
 
@@ -126,9 +186,15 @@ public:
         return type_;
     }
 
+    Class expr_class() const
+    {
+        return class_;
+    }
+
 protected:
 
     Type type_;
+    Class class_;
 
     std::string s_;
     union {
@@ -170,6 +236,34 @@ extern template
 std::basic_ostream<char> & operator <<
 (std::basic_ostream<char> &dst, Expr const &src);
 
+/// checks is expression an instance of T. Built-in classes are
+/// recognized using type and class tags, RTTI is used only for
+/// user-defined classes
+template <typename T>
+struct ExprIs
+{
+    static bool check(Expr const &e)
+    {
+        return dynamic_cast<T const*>(&e) != nullptr;
+    }
+};
+
+template <>
+struct ExprIs<Expr>
+{
+    static bool check(Expr const &) { return true; }
+};
+
+/// casts expression to T, \return nullptr if expression is null or
+/// is not an instance of T. Reference counter is incremented once
+template <typename T>
+std::shared_ptr<T> expr_cast(expr_ptr const &src)
+{
+    return (src && ExprIs<T>::check(*src))
+        ? std::shared_ptr<T>(src, static_cast<T*>(src.get()))
+        : std::shared_ptr<T>();
+}
+
 expr_ptr eval(env_ptr env, expr_ptr src);
 
 /// evaluates list using environment env. Returns result list,
@@ -181,11 +275,20 @@ template <Expr::Type T>
 class BasicExpr : public Expr
 {
 public:
-    BasicExpr(std::string const &s) : Expr(s, T) {}
+    BasicExpr(std::string const &s) : Expr(s, T) { class_ = BasicClass; }
 protected:
     virtual expr_ptr do_eval(env_ptr, expr_ptr);
 };
 
+template <Expr::Type T>
+struct ExprIs<BasicExpr<T> >
+{
+    static bool check(Expr const &e)
+    {
+        return e.expr_class() == Expr::BasicClass && e.type() == T;
+    }
+};
+
 typedef BasicExpr<Expr::String> String;
 typedef BasicExpr<Expr::Symbol> Symbol;
 typedef BasicExpr<Expr::Keyword> Keyword;
@@ -199,7 +302,7 @@ template <>
 class BasicExpr<Expr::Nil> : public Expr
 {
 public:
-    BasicExpr() : Expr() {}
+    BasicExpr() : Expr() { class_ = BasicClass; }
 protected:
     virtual expr_ptr do_eval(env_ptr, expr_ptr self) { return self; }
 };
@@ -224,11 +327,20 @@ class PodExpr : public Expr
 {
 public:
     template <typename T>
-    PodExpr(T v) : Expr(v) {}
+    PodExpr(T v) : Expr(v) { class_ = PodClass; }
 protected:
     virtual expr_ptr do_eval(env_ptr, expr_ptr);
 };
 
+template <>
+struct ExprIs<PodExpr>
+{
+    static bool check(Expr const &e)
+    {
+        return e.expr_class() == Expr::PodClass;
+    }
+};
+
 template <typename T>
 expr_ptr mk_value(T v)
 {
@@ -238,28 +350,82 @@ expr_ptr mk_value(T v)
 class SymbolExpr : public Expr
 {
 public:
-    SymbolExpr(std::string const &s) : Expr(s, Expr::Symbol) {}
+    SymbolExpr(std::string const &s) : Expr(s, Expr::Symbol)
+    {
+        class_ = SymbolClass;
+    }
 protected:
     virtual expr_ptr do_eval(env_ptr, expr_ptr);
 };
 
+template <>
+struct ExprIs<SymbolExpr>
+{
+    static bool check(Expr const &e)
+    {
+        return e.expr_class() == Expr::SymbolClass;
+    }
+};
+
 expr_ptr mk_symbol(std::string const &s);
 
+/// how function call parameters are evaluated. Parameters of the
+/// Parallel function which are function calls are evaluated
+/// concurrently by the thread pool, each parameter including its
+/// nested calls is evaluated by one thread. So called functions
+/// should be thread-safe and independent. Concurrent calls get the
+/// rest of the evaluation budget each, their usage is added to the
+/// budget when all of them are finished
+enum class ParamsEval {
+    Sequential,
+    Parallel
+};
+
 class FunctionExpr : public Expr
 {
 public:
-    FunctionExpr(std::string const &name) : Expr(name, Expr::Function) {}
+    FunctionExpr(std::string const &name,
+                 ParamsEval params_eval = ParamsEval::Sequential)
+        : Expr(name, Expr::Function), params_eval_(params_eval) {}
     virtual expr_ptr operator ()(env_ptr, expr_list_type &&) =0;
+
+    ParamsEval params_eval() const { return params_eval_; }
+
+private:
+    ParamsEval params_eval_;
+};
+
+/// user-defined function-typed expression can be derived directly
+/// from Expr, so RTTI is used for UserClass
+template <>
+struct ExprIs<FunctionExpr>
+{
+    static bool check(Expr const &e)
+    {
+        if (e.type() != Expr::Function)
+            return false;
+        switch (e.expr_class()) {
+        case Expr::LambdaClass:
+            return true;
+        case Expr::UserClass:
+            return dynamic_cast<FunctionExpr const*>(&e) != nullptr;
+        default:
+            return false;
+        }
+    }
 };
 
 class LambdaExpr : public FunctionExpr
 {
 public:
     LambdaExpr(std::string const &name,
-               lambda_type fn)
-        : FunctionExpr(name),
+               lambda_type fn,
+               ParamsEval params_eval = ParamsEval::Sequential)
+        : FunctionExpr(name, params_eval),
           fn(fn)
-    {}
+    {
+        class_ = LambdaClass;
+    }
 
     virtual expr_ptr operator ()(env_ptr env, expr_list_type &&params)
     {
@@ -271,7 +437,21 @@ private:
     lambda_type fn;
 };
 
-expr_ptr mk_lambda(std::string const &name, lambda_type const &fn);
+template <>
+struct ExprIs<LambdaExpr>
+{
+    static bool check(Expr const &e)
+    {
+        return e.expr_class() == Expr::LambdaClass;
+    }
+};
+
+expr_ptr mk_lambda(std::string const &name, lambda_type const &fn,
+                   ParamsEval params_eval = ParamsEval::Sequential);
+
+/// throws Error if expression is null or its type is not t
+void must_have_type(expr_ptr const &expr, Expr::Type t,
+                    char const *failure_msg);
 
 void to_string(expr_ptr expr, std::string &dst);
 void to_long(expr_ptr expr, long &dst);
@@ -281,9 +461,10 @@ template <typename T>
 void convert(expr_ptr, T &dst);
 
 static inline Env::item_type mk_record
-(std::string const &name, lambda_type const &fn)
+(std::string const &name, lambda_type const &fn,
+ ParamsEval params_eval = ParamsEval::Sequential)
 {
-    return std::make_pair(name, mk_lambda(name, fn));
+    return std::make_pair(name, mk_lambda(name, fn, params_eval));
 }
 
 static inline Env::item_type mk_const
@@ -301,10 +482,167 @@ static inline Env::item_type mk_const
 
 expr_ptr default_atom_convert(std::string &&s);
 
+/// limits of the evaluation, zero means no limit
+struct Limits
+{
+    Limits() : steps(0), depth(0), allocs(0) {}
+
+    /// count of evaluated expressions and function calls
+    unsigned long steps;
+    /// nesting level of lists
+    size_t depth;
+    /// count of created expressions
+    unsigned long allocs;
+};
+
+/// tracks resources used by evaluation and throws LimitExceeded if
+/// any of limits is exceeded
+class Budget
+{
+public:
+    Budget(Limits const &limits)
+        : limits(limits)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        steps_ = 0;
+        depth_ = 0;
+        exprs_before_ = exprs_created;
+        exprs_added_ = 0;
+    }
+
+    void step()
+    {
+        if (limits.steps && ++steps_ > limits.steps)
+            throw LimitExceeded(LimitExceeded::Steps, limits.steps);
+        check_exprs();
+    }
+
+    /// used resources, should be called from the thread using budget
+    unsigned long steps() const { return steps_; }
+    unsigned long exprs() const
+    {
+        return exprs_created - exprs_before_ + exprs_added_;
+    }
+
+    /// limits for the evaluation executed concurrently by other
+    /// thread: the rest of this budget
+    Limits rest() const;
+
+    /// account resources used by the concurrent evaluation
+    void add(unsigned long steps, unsigned long exprs)
+    {
+        steps_ += steps;
+        exprs_added_ += exprs;
+        if (limits.steps && steps_ > limits.steps)
+            throw LimitExceeded(LimitExceeded::Steps, limits.steps);
+        check_exprs();
+    }
+
+    void check_depth(size_t depth) const
+    {
+        if (limits.depth && depth > limits.depth)
+            throw LimitExceeded(LimitExceeded::Depth, limits.depth);
+    }
+
+    void enter() { check_depth(++depth_); }
+    void leave() { --depth_; }
+
+    Limits const limits;
+
+private:
+    void check_exprs() const
+    {
+        if (limits.allocs && exprs() > limits.allocs)
+            throw LimitExceeded(LimitExceeded::Allocations, limits.allocs);
+    }
+
+    unsigned long steps_;
+    size_t depth_;
+    unsigned long exprs_before_;
+    unsigned long exprs_added_;
+};
+
+/// gathers per-function statistics: call count, cumulative time,
+/// self time (w/o nested profiled calls made by the same thread) and
+/// count of expressions created during the call. Calls can be made
+/// from any thread, snapshot() can be taken from any thread
+class Profiler
+{
+public:
+    typedef std::chrono::steady_clock clock_type;
+
+    struct Stat
+    {
+        Stat() : calls(0), total(0), self(0), exprs(0) {}
+
+        unsigned long calls;
+        std::chrono::nanoseconds total;
+        std::chrono::nanoseconds self;
+        /// count of Expr objects created by the calling thread
+        /// during the call (incl. nested calls). Other allocations
+        /// are not counted
+        unsigned long exprs;
+    };
+
+    typedef std::map<std::string, Stat> snapshot_type;
+
+    /// RAII wrapper around profiled call, calls made by one thread
+    /// are chained to find the caller
+    class Call
+    {
+    public:
+        Call(Profiler &p, std::string const &name);
+        ~Call();
+    private:
+        Call(Call const &);
+        Call& operator =(Call const &);
+
+        Profiler &profiler_;
+        std::string const &name_;
+        clock_type::time_point begin_;
+        std::chrono::nanoseconds nested_;
+        unsigned long exprs_before_;
+        Call *caller_;
+    };
+
+    snapshot_type snapshot() const;
+    void clear();
+
+private:
+    void add(std::string const &name, std::chrono::nanoseconds total
+             , std::chrono::nanoseconds self, unsigned long exprs);
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Stat> stats_;
+};
+
+template <typename CharT>
+std::basic_ostream<CharT> & operator <<
+(std::basic_ostream<CharT> &dst, Profiler::snapshot_type const &src)
+{
+    for (auto const &v : src) {
+        auto const &s = v.second;
+        dst << v.first << " calls=" << s.calls
+            << " total=" << s.total.count() << "ns"
+            << " self=" << s.self.count() << "ns"
+            << " exprs=" << s.exprs << std::endl;
+    }
+    return dst;
+}
+
 class Interpreter
 {
 public:
     typedef std::function<expr_ptr (std::string &&)> atom_converter_type;
+    typedef std::function<void (expr_ptr)> result_handler_type;
+    typedef std::function<void (size_t, expr_list_type &)> batch_handler_type;
+    typedef std::function<void (size_t, cor::Error const &)>
+    batch_error_handler_type;
+
     Interpreter
     (env_ptr env,
      atom_converter_type atom_converter = &cor::notlisp::default_atom_convert);
@@ -312,12 +650,68 @@ public:
     Interpreter(Interpreter &&from)
         : env(from.env)
         , stack(std::move(from.stack))
+        , depth(from.depth)
         , convert_atom(from.convert_atom)
+        , on_result(std::move(from.on_result))
+        , profiler(std::move(from.profiler))
+        , budget(std::move(from.budget))
+        , executor(std::move(from.executor))
     {}
 
+    /// limit resources used by evaluation, usage is counted until
+    /// the next reset(). LimitExceeded is thrown if limit is exceeded
+    void set_limits(Limits const &limits)
+    {
+        budget = cor::make_unique<Budget>(limits);
+    }
+
+    /// profile function calls, profiling is off if p is null
+    void set_profiler(std::shared_ptr<Profiler> p)
+    {
+        profiler = std::move(p);
+    }
+
+    /// pool executing deferred calls of Parallel functions. If it is
+    /// not set, the pool shared by all interpreters is used. Calls
+    /// which are not started by the pool are executed by the waiting
+    /// thread, so pool can be used by the nested evaluations
+    void set_executor(std::shared_ptr<ThreadPool> pool)
+    {
+        executor = std::move(pool);
+    }
+
+    /// streaming mode: result of each evaluated top-level expression
+    /// is passed to the handler and released, so results() is kept
+    /// empty and memory usage does not depend on the input size
+    void set_result_handler(result_handler_type handler)
+    {
+        on_result = std::move(handler);
+    }
+
+    /// clear results and parsing state to reuse interpreter for the
+    /// next input. Allocated parsing stack is kept
+    void reset();
+
+    /// evaluate batch of inputs one by one using the same
+    /// interpreter. Interpreter is reset before each input, handler
+    /// receives input index and its results. The first error aborts
+    /// the whole batch, the rest of inputs are not evaluated
+    void eval_batch(std::vector<std::string> const &inputs,
+                    batch_handler_type handler);
+
+    /// the same but error of the input is passed to on_error and
+    /// evaluation continues with the next input
+    void eval_batch(std::vector<std::string> const &inputs,
+                    batch_handler_type handler,
+                    batch_error_handler_type on_error);
+
     void on_list_begin()
     {
-        stack.push(expr_list_type());
+        if (budget)
+            budget->check_depth(depth);
+        if (depth == stack.size())
+            stack.emplace_back();
+        ++depth;
     }
 
     void on_list_end();
@@ -325,7 +719,7 @@ public:
     void on_comment(std::string &&) { }
 
     void on_string(std::string &&s) {
-        stack.top().push_back(mk_string(s));
+        push_result(mk_string(s));
     }
 
     void on_atom(std::string &&s);
@@ -338,18 +732,74 @@ public:
         if (empty())
             throw Error("Interpreter has not any results");
 
-        return stack.top();
+        return stack[depth - 1];
     }
 
     bool empty() const
     {
-        return stack.empty();
+        return !depth;
     }
 
 private:
+    void push_result(expr_ptr &&);
+    bool is_in_parallel() const;
+
     env_ptr env;
-    std::stack<expr_list_type> stack;
+    // parsing stack, only first depth lists are used, the rest is
+    // kept to be reused
+    std::vector<expr_list_type> stack;
+    size_t depth;
     atom_converter_type convert_atom;
+    result_handler_type on_result;
+    std::shared_ptr<Profiler> profiler;
+    std::unique_ptr<Budget> budget;
+    std::shared_ptr<ThreadPool> executor;
+};
+
+/// cache of compiled forms for inputs repeated with different
+/// literals (e.g. rpc requests). Input shape (structure, symbols and
+/// keywords) is used as a key, numeric and string literals are
+/// parameters of the compiled form. Other atoms are converted and
+/// evaluated once when the form is compiled, so bindings used by
+/// cached forms should not be changed (or cache should be
+/// cleared). Least recently used forms are evicted when cache size
+/// exceeds capacity
+///
+/// Cache is not thread-safe: even eval() updates the LRU order, so
+/// calls should be serialized or each thread should have own cache
+class FormCacheImpl;
+class FormCache
+{
+public:
+    struct Stats
+    {
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions;
+        size_t size;
+    };
+
+    FormCache(env_ptr env, size_t capacity,
+              Interpreter::atom_converter_type atom_converter
+              = &cor::notlisp::default_atom_convert);
+    FormCache(FormCache &&);
+    virtual ~FormCache();
+
+    /// limit resources used by evaluation of each input (including
+    /// compilation). LimitExceeded is thrown if limit is exceeded
+    void set_limits(Limits const &limits);
+
+    /// profile function calls, profiling is off if p is null
+    void set_profiler(std::shared_ptr<Profiler> p);
+
+    /// evaluate input, \return results of top-level expressions
+    expr_list_type eval(std::string const &src);
+
+    Stats stats() const;
+    void clear();
+
+private:
+    std::unique_ptr<FormCacheImpl> impl_;
 };
 
 class ObjectExpr : public Expr
@@ -360,6 +810,29 @@ protected:
     virtual expr_ptr do_eval(env_ptr, expr_ptr);
 };
 
+/// user-defined object-typed expression can be derived directly
+/// from Expr, so RTTI is used for UserClass
+template <>
+struct ExprIs<ObjectExpr>
+{
+    static bool check(Expr const &e)
+    {
+        if (e.type() != Expr::Object)
+            return false;
+        switch (e.expr_class()) {
+        case Expr::ListClass:
+        case Expr::LongVectorClass:
+        case Expr::RealVectorClass:
+        case Expr::DictClass:
+            return true;
+        case Expr::UserClass:
+            return dynamic_cast<ObjectExpr const*>(&e) != nullptr;
+        default:
+            return false;
+        }
+    }
+};
+
 class ListAccessor
 {
 public:
@@ -392,6 +865,8 @@ public:
 
 private:
 
+    expr_ptr const& next_required();
+
     expr_list_type::const_iterator cur;
     expr_list_type::const_iterator end;
 };
@@ -408,7 +883,7 @@ ListAccessor& ListAccessor::required(void (*convert)(expr_ptr, T &dst), T &dst)
 template <typename T>
 std::shared_ptr<T> ListAccessor::required()
 {
-    return std::dynamic_pointer_cast<T>(required());
+    return expr_cast<T>(next_required());
 }
 
 template <typename ConsumerT>
@@ -428,8 +903,8 @@ template <typename T, typename FnT>
 void rest_casted(ListAccessor &src, FnT fn)
 {
     rest(src,
-         [&fn](expr_ptr p) {
-             auto res = std::dynamic_pointer_cast<T>(p);
+         [&fn](expr_ptr const &p) {
+             auto res = expr_cast<T>(p);
              if (!res)
                  throw Error("Can't be casted");
              fn(res);
@@ -459,7 +934,7 @@ void rest(ListAccessor &src, ArgFnT arg, KeyFnT kwd_ard)
 template <typename ContainerT, typename ConvertT>
 void push_rest(ListAccessor &src, ContainerT &dst, ConvertT convert)
 {
-    rest(src, [&dst, &convert](expr_ptr from) {
+    rest(src, [&dst, &convert](expr_ptr const &from) {
             dst.push_back(convert(from));
             return true;
         });
@@ -469,8 +944,8 @@ template <typename T>
 void push_rest_casted(ListAccessor &src, T &dst) {
     typedef typename T::value_type ptr_type;
     typedef typename ptr_type::element_type cast_type;
-    auto fn = [](expr_ptr from) {
-        auto res = std::dynamic_pointer_cast<cast_type>(from);
+    auto fn = [](expr_ptr const &from) {
+        auto res = expr_cast<cast_type>(from);
         if (!res)
             throw Error("Can't be casted");
         return res;
@@ -482,16 +957,25 @@ class List : public ObjectExpr
 {
 public:
     List(expr_list_type &src)
-        : ObjectExpr("list"), items(src) {}
+        : ObjectExpr("list"), items(src) { class_ = ListClass; }
 
     List(expr_list_type &&src)
-        : ObjectExpr("list"), items(std::move(src)) {}
+        : ObjectExpr("list"), items(std::move(src)) { class_ = ListClass; }
 
     expr_list_type items;
 protected:
     virtual expr_ptr do_eval(env_ptr, expr_ptr);
 };
 
+template <>
+struct ExprIs<List>
+{
+    static bool check(Expr const &e)
+    {
+        return e.expr_class() == Expr::ListClass;
+    }
+};
+
 static inline expr_ptr mk_list(expr_list_type &params)
 {
     return std::make_shared<List>(params);
@@ -502,6 +986,398 @@ static inline expr_ptr mk_list(expr_list_type &&params)
     return std::make_shared<List>(std::move(params));
 }
 
+template <typename T> struct VectorTraits;
+
+template <>
+struct VectorTraits<long>
+{
+    static const Expr::Class expr_class = Expr::LongVectorClass;
+};
+
+template <>
+struct VectorTraits<double>
+{
+    static const Expr::Class expr_class = Expr::RealVectorClass;
+};
+
+/// numeric vector, values are stored contiguously
+template <typename T>
+class Vector : public ObjectExpr
+{
+public:
+    typedef T value_type;
+
+    Vector(std::vector<T> const &src)
+        : ObjectExpr("vector"), items(src)
+    {
+        class_ = VectorTraits<T>::expr_class;
+    }
+
+    Vector(std::vector<T> &&src)
+        : ObjectExpr("vector"), items(std::move(src))
+    {
+        class_ = VectorTraits<T>::expr_class;
+    }
+
+    std::vector<T> items;
+};
+
+template <typename T>
+struct ExprIs<Vector<T> >
+{
+    static bool check(Expr const &e)
+    {
+        return e.expr_class() == VectorTraits<T>::expr_class;
+    }
+};
+
+template <typename T>
+expr_ptr mk_vector(std::vector<T> &&src)
+{
+    return std::make_shared<Vector<T> >(std::move(src));
+}
+
+template <typename T>
+expr_ptr mk_vector(std::vector<T> const &src)
+{
+    return std::make_shared<Vector<T> >(src);
+}
+
+/// convert numeric vector or list of numbers to std::vector,
+/// integers are converted to reals if T is double. Supported T are
+/// long and double
+template <typename T>
+void to_vector(expr_ptr const &expr, std::vector<T> &dst);
+
+/// dictionary with keys hashed, usually built from keyword arguments
+class Dict : public ObjectExpr
+{
+public:
+    typedef std::unordered_map<std::string, expr_ptr> map_type;
+
+    Dict() : ObjectExpr("dict") { class_ = DictClass; }
+
+    Dict(map_type &&src)
+        : ObjectExpr("dict"), items(std::move(src))
+    {
+        class_ = DictClass;
+    }
+
+    /// \return value for the key or nullptr if there is no such key
+    expr_ptr get(std::string const &key) const
+    {
+        auto p = items.find(key);
+        return p != items.end() ? p->second : nullptr;
+    }
+
+    map_type items;
+};
+
+template <>
+struct ExprIs<Dict>
+{
+    static bool check(Expr const &e)
+    {
+        return e.expr_class() == Expr::DictClass;
+    }
+};
+
+/// gather keyword arguments (:name value) from the rest of src into
+/// dst, positional arguments are passed to arg function. Value of
+/// repeated keyword replaces previous one
+template <typename ArgFnT>
+void rest_dict(ListAccessor &src, Dict::map_type &dst, ArgFnT arg)
+{
+    rest(src, arg, [&dst](expr_ptr const &k, expr_ptr const &v) {
+            dst[k->value()] = v;
+        });
+}
+
+/// build dictionary from keyword arguments list, throws Error if
+/// there are positional arguments
+expr_ptr mk_dict(expr_list_type const &params);
+
+/// records for dict functions: dict (creates dictionary from keyword
+/// arguments) and dict-get (returns value for a keyword or string
+/// key, nil if there is no such key)
+std::vector<Env::item_type> dict_records();
+
+/// save evaluated results to the binary snapshot file, snapshot is
+/// tagged with the hash of the source. Results can contain nil,
+/// numbers, strings, keywords, symbols, lists, vectors and dicts,
+/// Error is thrown for other expressions
+void save_snapshot(std::string const &path, std::string const &source,
+                   expr_list_type const &results);
+
+/// load results from the snapshot file (using mmap). \return false if
+/// snapshot is absent, broken or was made from a different source
+bool load_snapshot(std::string const &path, std::string const &source,
+                   expr_list_type &dst);
+
+typedef std::function<void (cor::Error const &)> snapshot_error_handler_type;
+
+/// load results of the source evaluation from the snapshot if it is
+/// up to date, otherwise evaluate source and save the snapshot. If
+/// snapshot can't be saved, error is passed to on_save_error and
+/// results are returned, w/o handler error is thrown
+expr_list_type eval_snapshot(env_ptr env, std::string const &source,
+                             std::string const &snapshot_path,
+                             snapshot_error_handler_type on_save_error
+                             = snapshot_error_handler_type());
+
+/// records for vector functions: vector (creates vector from
+/// numbers), vector-sum, vector-min, vector-max, vector-scale and
+/// vector-dot. Functions return integers/integer vectors if all
+/// arguments are integers, reals otherwise
+std::vector<Env::item_type> vector_records();
+
+namespace native
+{
+
+/// conversion of the native function parameter from the expression,
+/// specialized for supported parameter types. Scalars are returned by
+/// value, strings and expressions - by reference
+template <typename T, typename Enable = void> struct Param;
+
+template <typename T>
+struct Param<T, typename std::enable_if<std::is_integral<T>::value>::type>
+{
+    typedef T type;
+    static T get(expr_ptr const &e)
+    {
+        must_have_type(e, Expr::Integer, "Native integer param");
+        return static_cast<T>((long)*e);
+    }
+};
+
+template <typename T>
+struct Param<T, typename std::enable_if
+             <std::is_floating_point<T>::value>::type>
+{
+    typedef T type;
+    static T get(expr_ptr const &e)
+    {
+        must_have_type(e, Expr::Real, "Native real param");
+        return static_cast<T>((double)*e);
+    }
+};
+
+template <>
+struct Param<std::string>
+{
+    typedef std::string const& type;
+    static std::string const& get(expr_ptr const &e)
+    {
+        must_have_type(e, Expr::String, "Native string param");
+        return e->value();
+    }
+};
+
+template <>
+struct Param<expr_ptr>
+{
+    typedef expr_ptr const& type;
+    static expr_ptr const& get(expr_ptr const &e) { return e; }
+};
+
+template <typename T>
+struct Param<std::shared_ptr<T> >
+{
+    typedef std::shared_ptr<T> type;
+    static std::shared_ptr<T> get(expr_ptr const &e)
+    {
+        auto res = expr_cast<T>(e);
+        if (!res)
+            throw Error("Native param can't be casted");
+        return res;
+    }
+};
+
+/// conversion of the native function result to the expression
+template <typename T, typename Enable = void> struct Result;
+
+template <typename T>
+struct Result<T, typename std::enable_if<std::is_integral<T>::value>::type>
+{
+    static expr_ptr get(T v) { return mk_value(static_cast<long>(v)); }
+};
+
+template <typename T>
+struct Result<T, typename std::enable_if
+              <std::is_floating_point<T>::value>::type>
+{
+    static expr_ptr get(T v) { return mk_value(static_cast<double>(v)); }
+};
+
+template <>
+struct Result<std::string>
+{
+    static expr_ptr get(std::string const &v) { return mk_string(v); }
+};
+
+template <typename T>
+struct Result<std::shared_ptr<T> >
+{
+    static expr_ptr get(std::shared_ptr<T> const &v) { return v; }
+};
+
+template <typename FnT, size_t N>
+struct ParamType
+{
+    typedef typename std::decay
+    <typename function_traits<FnT>::template Arg<N>::type>::type type;
+};
+
+template <typename FnT, size_t Offset, typename IndicesT>
+struct ParamsTuple;
+
+template <typename FnT, size_t Offset, size_t ... I>
+struct ParamsTuple<FnT, Offset, Indices<I...> >
+{
+    typedef std::tuple<typename ParamType<FnT, Offset + I>::type...> type;
+};
+
+/// wraps native function FnT, parameters are converted to the types
+/// of FnT arguments. Parameters can be passed positionally or as
+/// keyword arguments (if names are supplied), the last
+/// sizeof...(DefaultsT) parameters can be omitted
+template <typename FnT, typename ... DefaultsT>
+class Function
+{
+    typedef function_traits<FnT> traits_type;
+    typedef typename traits_type::result_type result_type;
+
+    static const size_t arity = traits_type::arity;
+    static const size_t first_default = arity - sizeof...(DefaultsT);
+
+    static_assert(sizeof...(DefaultsT) <= arity,
+                  "More defaults than function arguments");
+
+    typedef typename ParamsTuple
+    <FnT, first_default
+     , typename MakeIndices<sizeof...(DefaultsT)>::type>::type defaults_type;
+
+    typedef std::array<expr_ptr const*, arity> args_type;
+    typedef typename MakeIndices<arity>::type indices_type;
+
+public:
+    Function(FnT fn, std::vector<std::string> const &names,
+             DefaultsT ... defaults)
+        : fn_(fn), names_(names), defaults_(defaults...)
+    {
+        if (!names_.empty() && names_.size() != arity)
+            throw Error("Native function has %d args, got %d names",
+                        (int)arity, (int)names_.size());
+    }
+
+    expr_ptr operator ()(env_ptr, expr_list_type &params) const
+    {
+        args_type args;
+        args.fill(nullptr);
+        bind(params, args);
+        return call(args, indices_type(), std::is_void<result_type>());
+    }
+
+private:
+
+    void bind(expr_list_type const &params, args_type &args) const
+    {
+        size_t pos = 0;
+        for (auto it = params.begin(); it != params.end(); ++it) {
+            auto const &v = *it;
+            size_t i = pos;
+            if (v && v->type() == Expr::Keyword) {
+                i = index(v->value());
+                if (++it == params.end())
+                    throw Error("Orphaned keyword %s", v->value().c_str());
+            } else {
+                ++pos;
+            }
+            if (i >= arity)
+                throw Error("Too many params, expected %d", (int)arity);
+            if (args[i])
+                throw Error("Param %d is already set", (int)i);
+            args[i] = &*it;
+        }
+    }
+
+    size_t index(std::string const &name) const
+    {
+        for (size_t i = 0; i < names_.size(); ++i)
+            if (names_[i] == name)
+                return i;
+        throw Error("Unknown keyword %s", name.c_str());
+    }
+
+    template <size_t I>
+    typename Param<typename ParamType<FnT, I>::type>::type
+    get(args_type const &args) const
+    {
+        typedef Param<typename ParamType<FnT, I>::type> param_type;
+        return args[I]
+            ? param_type::get(*args[I])
+            : get_default<I>(std::integral_constant
+                             <bool, (I >= first_default)>());
+    }
+
+    template <size_t I>
+    typename Param<typename ParamType<FnT, I>::type>::type
+    get_default(std::true_type) const
+    {
+        return std::get<I - first_default>(defaults_);
+    }
+
+    template <size_t I>
+    typename Param<typename ParamType<FnT, I>::type>::type
+    get_default(std::false_type) const
+    {
+        throw Error("Required param %d is absent", (int)I);
+    }
+
+    template <size_t ... I>
+    expr_ptr call(args_type const &args, Indices<I...>,
+                  std::false_type) const
+    {
+        typedef typename std::decay<result_type>::type res_type;
+        return Result<res_type>::get(fn_(get<I>(args)...));
+    }
+
+    template <size_t ... I>
+    expr_ptr call(args_type const &args, Indices<I...>,
+                  std::true_type) const
+    {
+        fn_(get<I>(args)...);
+        return mk_nil();
+    }
+
+    FnT fn_;
+    std::vector<std::string> names_;
+    defaults_type defaults_;
+};
+
+} // native
+
+/// create environment record for native function fn (function
+/// pointer or lambda). Parameters are converted to fn argument types
+/// and checked before the call
+template <typename FnT>
+Env::item_type mk_native(std::string const &name, FnT fn)
+{
+    return mk_record(name, native::Function<FnT>(fn, {}));
+}
+
+/// create environment record for native function fn, names are used
+/// to pass parameters as keyword arguments (:name value), defaults
+/// are used for the last omitted parameters
+template <typename FnT, typename ... DefaultsT>
+Env::item_type mk_native(std::string const &name, FnT fn,
+                         std::vector<std::string> const &names,
+                         DefaultsT ... defaults)
+{
+    return mk_record(name, native::Function<FnT, DefaultsT...>
+                     (fn, names, defaults...));
+}
+
 }} // cor::notlisp
 
 #endif // _COR_NOTLISP_HPP_
@@ -507,6 +507,19 @@ struct function_traits<ResT(T::*)(Args...) const>
     };
 };
 
+/// compile-time sequence of indices to be used to unpack tuples and
+/// function arguments
+template <size_t ... I> struct Indices {};
+
+template <size_t N, size_t ... I>
+struct MakeIndices : public MakeIndices<N - 1, N - 1, I...> {};
+
+template <size_t ... I>
+struct MakeIndices<0, I...>
+{
+    typedef Indices<I...> type;
+};
+
 template <size_t N> struct TupleSelector<N, N>
 {
 
@@ -0,0 +1,363 @@
+#include <cor/event_loop.hpp>
+#include <cor/util.hpp>
+
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace cor
+{
+
+static_assert(EPOLLIN == POLLIN && EPOLLOUT == POLLOUT
+              && EPOLLPRI == POLLPRI && EPOLLRDHUP == POLLRDHUP
+              , "epoll and poll events are expected to be the same");
+
+namespace {
+
+struct Source
+{
+    typedef EventLoop::handler_type handler_type;
+
+    Source(int fd, uint64_t key, uint32_t events, uint32_t flags)
+        : fd(fd), key(key), events(events), flags(flags), queue(nullptr)
+    {}
+
+    int fd;
+    // fd can be closed and reused without removal from the loop, key
+    // is used to detect events for the replaced source
+    uint64_t key;
+    uint32_t events;
+    uint32_t flags;
+    handler_type handler;
+    TaskQueue *queue;
+    Task once;
+};
+
+typedef std::shared_ptr<Source> source_ptr;
+
+/// key of the wakeup eventfd
+uint64_t const wakeup_key = 0;
+
+/// exceptions are not propagated from handlers to the loop, they
+/// are logged. Unknown exceptions terminate the process
+template <typename FnT>
+void call(FnT &&fn)
+{
+    error_trace_msg_nothrow("EventLoop handler: ", [&fn]() { fn(); });
+}
+
+}
+
+class EventLoopImpl : public std::enable_shared_from_this<EventLoopImpl>
+{
+public:
+    EventLoopImpl();
+
+    void add(source_ptr &&);
+    void modify(int, uint32_t);
+    void remove(int);
+    source_ptr create(int fd, uint32_t events, uint32_t flags)
+    {
+        return std::make_shared<Source>(fd, next_key(fd), events, flags);
+    }
+
+    bool enqueue(Task);
+    size_t run_once(int);
+    void stop();
+    bool is_stopped() const { return is_stopped_; }
+    void wakeup();
+    int fd() const { return epoll_.value(); }
+
+private:
+    uint64_t next_key(int fd)
+    {
+        return (static_cast<uint64_t>(++generation_) << 32)
+            | static_cast<uint32_t>(fd);
+    }
+
+    int ctl(int, Source const &);
+    void dispatch(uint64_t, uint32_t);
+    void rearm(source_ptr const &);
+    size_t execute_tasks();
+
+    FdHandle epoll_;
+    FdHandle wakeup_;
+    std::atomic<bool> is_stopped_;
+    std::atomic<bool> is_woken_;
+    std::atomic<uint32_t> generation_;
+
+    std::mutex mutex_;
+    std::unordered_map<int, source_ptr> sources_;
+    std::vector<Task> tasks_;
+};
+
+EventLoopImpl::EventLoopImpl()
+    : epoll_(::epoll_create1(EPOLL_CLOEXEC))
+    , wakeup_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    , is_stopped_(false)
+    , is_woken_(false)
+    , generation_(0)
+{
+    if (!epoll_.is_valid())
+        throw CError(errno, "Can't create epoll");
+    if (!wakeup_.is_valid())
+        throw CError(errno, "Can't create eventfd");
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = wakeup_key;
+    if (::epoll_ctl(epoll_.value(), EPOLL_CTL_ADD, wakeup_.value(), &ev) < 0)
+        throw CError(errno, "Can't add eventfd to epoll");
+}
+
+int EventLoopImpl::ctl(int op, Source const &src)
+{
+    epoll_event ev;
+    ev.events = src.events | src.flags;
+    ev.data.u64 = src.key;
+    return ::epoll_ctl(epoll_.value(), op, src.fd, &ev);
+}
+
+void EventLoopImpl::add(source_ptr &&src)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ctl(EPOLL_CTL_ADD, *src) < 0) {
+        if (errno == EEXIST)
+            throw Error("fd %d is already registered", src->fd);
+        throw CError(errno, "Can't add fd to epoll");
+    }
+    // stale entry is left if fd was closed without removal
+    sources_[src->fd] = std::move(src);
+}
+
+void EventLoopImpl::modify(int fd, uint32_t events)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sources_.find(fd);
+    if (it == sources_.end())
+        throw Error("fd %d is not registered", fd);
+    auto &src = *it->second;
+    src.events = events;
+    if (ctl(EPOLL_CTL_MOD, src) < 0)
+        throw CError(errno, "Can't modify epoll fd");
+}
+
+void EventLoopImpl::remove(int fd)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!sources_.erase(fd))
+        return;
+    // fd can be already closed and removed from epoll
+    ::epoll_ctl(epoll_.value(), EPOLL_CTL_DEL, fd, nullptr);
+}
+
+bool EventLoopImpl::enqueue(Task task)
+{
+    if (is_stopped_)
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    wakeup();
+    return true;
+}
+
+void EventLoopImpl::wakeup()
+{
+    if (is_woken_.exchange(true))
+        return;
+    uint64_t v = 1;
+    while (::write(wakeup_.value(), &v, sizeof(v)) < 0 && errno == EINTR) {}
+}
+
+void EventLoopImpl::stop()
+{
+    is_stopped_ = true;
+    wakeup();
+}
+
+void EventLoopImpl::rearm(source_ptr const &src)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sources_.find(src->fd);
+    if (it != sources_.end() && it->second == src)
+        ctl(EPOLL_CTL_MOD, *src);
+}
+
+void EventLoopImpl::dispatch(uint64_t key, uint32_t events)
+{
+    int fd = static_cast<int>(key & 0xffffffff);
+    source_ptr src;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = sources_.find(fd);
+        if (it == sources_.end() || it->second->key != key)
+            return;
+        src = it->second;
+        if (src->once) {
+            sources_.erase(it);
+            ::epoll_ctl(epoll_.value(), EPOLL_CTL_DEL, fd, nullptr);
+        }
+    }
+
+    if (src->once) {
+        call(src->once);
+        src->once.reset();
+    } else if (src->queue) {
+        std::weak_ptr<EventLoopImpl> self(shared_from_this());
+        // source stays disarmed if the queue is stopped
+        src->queue->enqueue([self, src, events]() {
+                call([&src, events]() { src->handler(events); });
+                auto loop = self.lock();
+                if (loop)
+                    loop->rearm(src);
+            });
+    } else {
+        call([&src, events]() { src->handler(events); });
+    }
+}
+
+size_t EventLoopImpl::execute_tasks()
+{
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::swap(tasks, tasks_);
+    }
+    for (auto &task : tasks)
+        call(task);
+    return tasks.size();
+}
+
+size_t EventLoopImpl::run_once(int timeout_msec)
+{
+    static const int max_events = 64;
+    epoll_event events[max_events];
+
+    auto count = ::epoll_wait(epoll_.value(), events, max_events
+                              , timeout_msec);
+    if (count < 0) {
+        if (errno == EINTR)
+            return 0;
+        throw CError(errno, "epoll_wait failed");
+    }
+
+    size_t res = 0;
+    bool is_woken = false;
+    for (int i = 0; i < count; ++i) {
+        auto const &ev = events[i];
+        if (ev.data.u64 == wakeup_key) {
+            is_woken = true;
+            continue;
+        }
+        dispatch(ev.data.u64, ev.events);
+        ++res;
+    }
+    if (is_woken) {
+        uint64_t v;
+        while (::read(wakeup_.value(), &v, sizeof(v)) < 0 && errno == EINTR) {}
+        // reset after reading, so wakeup after this point is not lost
+        is_woken_ = false;
+    }
+    return res + execute_tasks();
+}
+
+EventLoop::EventLoop()
+    : impl_(std::make_shared<EventLoopImpl>())
+{
+}
+
+EventLoop::EventLoop(EventLoop &&src)
+    : impl_(std::move(src.impl_))
+{
+}
+
+EventLoop::~EventLoop()
+{
+}
+
+void EventLoop::add(int fd, uint32_t events, handler_type handler, Mode mode)
+{
+    auto src = impl_->create(fd, events, mode == Edge ? (uint32_t)EPOLLET : 0);
+    src->handler = std::move(handler);
+    impl_->add(std::move(src));
+}
+
+void EventLoop::add(int fd, uint32_t events, TaskQueue &queue
+                    , handler_type handler)
+{
+    auto src = impl_->create(fd, events, EPOLLONESHOT);
+    src->handler = std::move(handler);
+    src->queue = &queue;
+    impl_->add(std::move(src));
+}
+
+void EventLoop::modify(int fd, uint32_t events)
+{
+    impl_->modify(fd, events);
+}
+
+void EventLoop::remove(int fd)
+{
+    impl_->remove(fd);
+}
+
+bool EventLoop::watch_once(int fd, short poll_events, Task task)
+{
+    if (impl_->is_stopped())
+        return false;
+    auto src = impl_->create(fd, static_cast<uint16_t>(poll_events)
+                             , EPOLLONESHOT);
+    src->once = std::move(task);
+    try {
+        impl_->add(std::move(src));
+    } catch (Error const &) {
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::enqueue(Task task)
+{
+    return impl_->enqueue(std::move(task));
+}
+
+size_t EventLoop::run_once(int timeout_msec)
+{
+    return impl_->run_once(timeout_msec);
+}
+
+void EventLoop::run()
+{
+    while (!impl_->is_stopped())
+        impl_->run_once(-1);
+}
+
+void EventLoop::stop()
+{
+    impl_->stop();
+}
+
+bool EventLoop::is_stopped() const
+{
+    return impl_->is_stopped();
+}
+
+void EventLoop::wakeup()
+{
+    impl_->wakeup();
+}
+
+int EventLoop::fd() const
+{
+    return impl_->fd();
+}
+
+}
@@ -0,0 +1,603 @@
+#include <cor/io_engine.hpp>
+#include <cor/event_loop.hpp>
+#include <cor/util.hpp>
+
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+namespace cor
+{
+
+namespace {
+
+enum OpKind { ReadOp, WriteOp, ReadFixedOp, WriteFixedOp };
+
+struct Op
+{
+    OpKind kind;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+    unsigned buf_index;
+    IoEngine::handler_type handler;
+};
+
+/// exceptions are not propagated from completion handlers, they are
+/// logged. Unknown exceptions terminate the process
+void call(IoEngine::handler_type &handler, ssize_t res)
+{
+    error_trace_msg_nothrow("IoEngine handler: "
+                            , [&handler, res]() { handler(res); });
+}
+
+}
+
+class IoEngineImpl
+{
+public:
+    virtual ~IoEngineImpl() {}
+
+    void add(Op &&op)
+    {
+        unsigned idx;
+        if (free_.empty()) {
+            idx = ops_.size();
+            ops_.push_back(std::move(op));
+        } else {
+            idx = free_.back();
+            free_.pop_back();
+            ops_[idx] = std::move(op);
+        }
+        try {
+            queue(idx);
+        } catch (...) {
+            ops_[idx].handler = nullptr;
+            free_.push_back(idx);
+            throw;
+        }
+    }
+
+    size_t pending() const { return ops_.size() - free_.size(); }
+
+    virtual IoEngine::Backend backend() const = 0;
+    virtual void register_buffers(std::vector<iovec> const &) = 0;
+    virtual size_t submit() = 0;
+    virtual size_t run_once(int) = 0;
+    virtual int fd() const = 0;
+
+protected:
+    virtual void queue(unsigned) = 0;
+
+    /// slot is released before the handler is called, so handler can
+    /// add new operations
+    void complete(unsigned idx, ssize_t res)
+    {
+        auto handler = std::move(ops_[idx].handler);
+        ops_[idx].handler = nullptr;
+        free_.push_back(idx);
+        call(handler, res);
+    }
+
+    std::vector<Op> ops_;
+
+private:
+    std::vector<unsigned> free_;
+};
+
+namespace {
+
+template <typename T>
+T load_acquire(T const *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+void store_release(T *p, T v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+int uring_setup(unsigned entries, io_uring_params *params)
+{
+    std::memset(params, 0, sizeof(*params));
+    return ::syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete
+                , unsigned flags)
+{
+    return ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete
+                     , flags, nullptr, 0);
+}
+
+int uring_register(int fd, unsigned opcode, void const *arg, unsigned count)
+{
+    return ::syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/// user_data of the internal timeout operation
+uint64_t const timeout_key = ~0ULL;
+
+class Mapping
+{
+public:
+    Mapping() : p_(MAP_FAILED), size_(0) {}
+
+    ~Mapping()
+    {
+        if (p_ != MAP_FAILED)
+            ::munmap(p_, size_);
+    }
+
+    void map(int fd, size_t size, off_t offset)
+    {
+        p_ = ::mmap(nullptr, size, PROT_READ | PROT_WRITE
+                    , MAP_SHARED | MAP_POPULATE, fd, offset);
+        if (p_ == MAP_FAILED)
+            throw CError(errno, "Can't map io_uring");
+        size_ = size;
+    }
+
+    template <typename T>
+    T *at(size_t offset) const
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(p_) + offset);
+    }
+
+private:
+    Mapping(Mapping const &);
+    Mapping & operator =(Mapping const &);
+
+    void *p_;
+    size_t size_;
+};
+
+class UringEngine : public IoEngineImpl
+{
+public:
+    UringEngine(unsigned entries);
+
+    virtual IoEngine::Backend backend() const { return IoEngine::Uring; }
+    virtual void register_buffers(std::vector<iovec> const &);
+    virtual size_t submit();
+    virtual size_t run_once(int);
+    virtual int fd() const { return eventfd_.value(); }
+
+protected:
+    virtual void queue(unsigned);
+
+private:
+    io_uring_sqe *next_sqe();
+    int enter(unsigned min_complete, unsigned flags);
+    size_t reap();
+
+    io_uring_params params_;
+    FdHandle ring_;
+    FdHandle eventfd_;
+    Mapping rings_;
+    Mapping sqes_mem_;
+
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned *sq_array_;
+    unsigned sq_mask_;
+    io_uring_sqe *sqes_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe *cqes_;
+
+    // local tail, published to the kernel on submission
+    unsigned tail_;
+    bool has_buffers_;
+    __kernel_timespec timeout_;
+};
+
+UringEngine::UringEngine(unsigned entries)
+    : ring_(uring_setup(entries, &params_))
+    , eventfd_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    , has_buffers_(false)
+{
+    if (!ring_.is_valid())
+        throw CError(errno, "Can't setup io_uring");
+    // single mmap and reads from the current position are available
+    // since 5.4 and 5.6
+    if (!(params_.features & IORING_FEAT_SINGLE_MMAP)
+        || !(params_.features & IORING_FEAT_RW_CUR_POS))
+        throw Error("io_uring is too old, features %x", params_.features);
+    if (!eventfd_.is_valid())
+        throw CError(errno, "Can't create eventfd");
+
+    auto const &sq = params_.sq_off;
+    auto const &cq = params_.cq_off;
+    auto size = std::max(sq.array + params_.sq_entries * sizeof(unsigned)
+                         , cq.cqes + params_.cq_entries * sizeof(io_uring_cqe));
+    rings_.map(ring_.value(), size, IORING_OFF_SQ_RING);
+    sqes_mem_.map(ring_.value(), params_.sq_entries * sizeof(io_uring_sqe)
+                  , IORING_OFF_SQES);
+
+    sq_head_ = rings_.at<unsigned>(sq.head);
+    sq_tail_ = rings_.at<unsigned>(sq.tail);
+    sq_array_ = rings_.at<unsigned>(sq.array);
+    sq_mask_ = *rings_.at<unsigned>(sq.ring_mask);
+    sqes_ = sqes_mem_.at<io_uring_sqe>(0);
+    cq_head_ = rings_.at<unsigned>(cq.head);
+    cq_tail_ = rings_.at<unsigned>(cq.tail);
+    cq_mask_ = *rings_.at<unsigned>(cq.ring_mask);
+    cqes_ = rings_.at<io_uring_cqe>(cq.cqes);
+    tail_ = *sq_tail_;
+
+    int efd = eventfd_.value();
+    if (uring_register(ring_.value(), IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+        throw CError(errno, "Can't register eventfd");
+}
+
+void UringEngine::register_buffers(std::vector<iovec> const &buffers)
+{
+    if (has_buffers_) {
+        uring_register(ring_.value(), IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        has_buffers_ = false;
+    }
+    if (buffers.empty())
+        return;
+    if (uring_register(ring_.value(), IORING_REGISTER_BUFFERS
+                       , buffers.data(), buffers.size()) < 0)
+        throw CError(errno, "Can't register buffers");
+    has_buffers_ = true;
+}
+
+io_uring_sqe *UringEngine::next_sqe()
+{
+    if (tail_ - load_acquire(sq_head_) >= params_.sq_entries) {
+        submit();
+        if (tail_ - load_acquire(sq_head_) >= params_.sq_entries)
+            throw Error("io_uring submission queue is full");
+    }
+    auto idx = tail_ & sq_mask_;
+    sq_array_[idx] = idx;
+    ++tail_;
+    auto res = &sqes_[idx];
+    std::memset(res, 0, sizeof(*res));
+    return res;
+}
+
+void UringEngine::queue(unsigned idx)
+{
+    static const uint8_t opcodes[] = {
+        IORING_OP_READ, IORING_OP_WRITE
+        , IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED
+    };
+    auto const &op = ops_[idx];
+    auto sqe = next_sqe();
+    sqe->opcode = opcodes[op.kind];
+    sqe->fd = op.fd;
+    sqe->off = static_cast<uint64_t>(op.offset);
+    sqe->addr = reinterpret_cast<uint64_t>(op.buf);
+    sqe->len = op.len;
+    sqe->buf_index = op.buf_index;
+    sqe->user_data = idx;
+}
+
+int UringEngine::enter(unsigned min_complete, unsigned flags)
+{
+    store_release(sq_tail_, tail_);
+    auto to_submit = tail_ - load_acquire(sq_head_);
+    int rc;
+    do {
+        rc = uring_enter(ring_.value(), to_submit, min_complete, flags);
+    } while (rc < 0 && errno == EINTR);
+    // EBUSY: completion queue is overflown, submit after reaping
+    if (rc < 0 && errno != EBUSY && errno != EAGAIN)
+        throw CError(errno, "io_uring_enter failed");
+    return rc;
+}
+
+size_t UringEngine::submit()
+{
+    if (tail_ == load_acquire(sq_head_))
+        return 0;
+    auto rc = enter(0, 0);
+    return rc > 0 ? rc : 0;
+}
+
+size_t UringEngine::reap()
+{
+    size_t res = 0;
+    auto head = *cq_head_;
+    while (head != load_acquire(cq_tail_)) {
+        auto const &cqe = cqes_[head & cq_mask_];
+        auto key = cqe.user_data;
+        auto rc = cqe.res;
+        // release entry before calling handler, it can submit new ops
+        store_release(cq_head_, ++head);
+        if (key == timeout_key)
+            continue;
+        complete(static_cast<unsigned>(key), rc);
+        ++res;
+        head = *cq_head_;
+    }
+    return res;
+}
+
+size_t UringEngine::run_once(int timeout_msec)
+{
+    uint64_t v;
+    while (::read(eventfd_.value(), &v, sizeof(v)) < 0 && errno == EINTR) {}
+
+    submit();
+    auto res = reap();
+    if (res || !timeout_msec || !pending())
+        return res;
+
+    if (timeout_msec > 0) {
+        timeout_.tv_sec = timeout_msec / 1000;
+        timeout_.tv_nsec = (timeout_msec % 1000) * 1000000L;
+        auto sqe = next_sqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&timeout_);
+        sqe->len = 1;
+        // completed also when any other operation is completed
+        sqe->off = 1;
+        sqe->user_data = timeout_key;
+    }
+    enter(1, IORING_ENTER_GETEVENTS);
+    return reap();
+}
+
+ssize_t execute(Op const &op)
+{
+    ssize_t rc;
+    do {
+        switch (op.kind) {
+        case ReadOp:
+        case ReadFixedOp:
+            rc = (op.offset < 0)
+                ? ::read(op.fd, op.buf, op.len)
+                : ::pread(op.fd, op.buf, op.len, op.offset);
+            break;
+        default:
+            rc = (op.offset < 0)
+                ? ::write(op.fd, op.buf, op.len)
+                : ::pwrite(op.fd, op.buf, op.len, op.offset);
+            break;
+        }
+    } while (rc < 0 && errno == EINTR);
+    return rc < 0 ? -errno : rc;
+}
+
+class EpollEngine : public IoEngineImpl
+{
+public:
+    virtual IoEngine::Backend backend() const { return IoEngine::Epoll; }
+    /// nothing to pin, fixed operations are executed as usual ones
+    virtual void register_buffers(std::vector<iovec> const &) {}
+    virtual size_t submit();
+    virtual size_t run_once(int);
+    virtual int fd() const { return loop_.fd(); }
+
+protected:
+    virtual void queue(unsigned idx) { queued_.push_back(idx); }
+
+private:
+    // reads and writes are queued separately, so pending read does not
+    // block writes on the full-duplex fd
+    struct FdOps
+    {
+        FdOps() : events(0) {}
+
+        std::deque<unsigned> reads;
+        std::deque<unsigned> writes;
+        // events fd is registered in the loop with
+        uint32_t events;
+    };
+
+    static bool is_read(Op const &op)
+    {
+        return op.kind == ReadOp || op.kind == ReadFixedOp;
+    }
+
+    void update(int);
+    void on_ready(int, uint32_t);
+    void execute_front(std::deque<unsigned> &);
+
+    EventLoop loop_;
+    std::vector<unsigned> queued_;
+    // operations of the same direction on fd are executed in order
+    std::unordered_map<int, FdOps> fds_;
+    std::vector<std::pair<unsigned, ssize_t> > done_;
+};
+
+size_t EpollEngine::submit()
+{
+    std::vector<unsigned> ops;
+    std::swap(ops, queued_);
+    for (auto idx : ops) {
+        auto const &op = ops_[idx];
+        auto &fd_ops = fds_[op.fd];
+        (is_read(op) ? fd_ops.reads : fd_ops.writes).push_back(idx);
+        update(op.fd);
+    }
+    return ops.size();
+}
+
+/// register fd in the loop for events of pending operations
+void EpollEngine::update(int fd)
+{
+    auto it = fds_.find(fd);
+    if (it == fds_.end())
+        return;
+    auto &fd_ops = it->second;
+    uint32_t events = (fd_ops.reads.empty() ? 0 : (uint32_t)EPOLLIN)
+        | (fd_ops.writes.empty() ? 0 : (uint32_t)EPOLLOUT);
+    if (events == fd_ops.events)
+        return;
+
+    if (!events) {
+        loop_.remove(fd);
+        fds_.erase(it);
+        return;
+    }
+    try {
+        if (fd_ops.events)
+            loop_.modify(fd, events);
+        else
+            loop_.add(fd, events, [this, fd](uint32_t ready) {
+                    on_ready(fd, ready);
+                });
+        fd_ops.events = events;
+        return;
+    } catch (Error const &) {
+        if (fd_ops.events)
+            throw;
+    }
+
+    // fd can't be polled (e.g. regular file), it is always ready
+    while (!fd_ops.reads.empty())
+        execute_front(fd_ops.reads);
+    while (!fd_ops.writes.empty())
+        execute_front(fd_ops.writes);
+    fds_.erase(it);
+    loop_.wakeup();
+}
+
+void EpollEngine::execute_front(std::deque<unsigned> &ops)
+{
+    auto idx = ops.front();
+    ops.pop_front();
+    done_.emplace_back(idx, execute(ops_[idx]));
+}
+
+/// one operation of each ready direction is executed, errors and
+/// hangups are reported by executing them
+void EpollEngine::on_ready(int fd, uint32_t ready)
+{
+    auto it = fds_.find(fd);
+    if (it == fds_.end())
+        return;
+    auto &fd_ops = it->second;
+    uint32_t const failed = EPOLLERR | EPOLLHUP;
+    if ((ready & (EPOLLIN | failed)) && !fd_ops.reads.empty())
+        execute_front(fd_ops.reads);
+    if ((ready & (EPOLLOUT | failed)) && !fd_ops.writes.empty())
+        execute_front(fd_ops.writes);
+    update(fd);
+}
+
+size_t EpollEngine::run_once(int timeout_msec)
+{
+    submit();
+    loop_.run_once(done_.empty() && pending() ? timeout_msec : 0);
+
+    std::vector<std::pair<unsigned, ssize_t> > done;
+    std::swap(done, done_);
+    for (auto const &v : done)
+        complete(v.first, v.second);
+    return done.size();
+}
+
+std::unique_ptr<IoEngineImpl> create_engine
+(unsigned entries, IoEngine::Backend backend)
+{
+    if (backend != IoEngine::Epoll) {
+        try {
+            return cor::make_unique<UringEngine>(entries);
+        } catch (Error const &) {
+            if (backend == IoEngine::Uring)
+                throw;
+        }
+    }
+    return cor::make_unique<EpollEngine>();
+}
+
+Op mk_op(OpKind kind, int fd, void const *buf, size_t len, off_t offset
+         , unsigned buf_index, IoEngine::handler_type &&handler)
+{
+    return Op{kind, fd, const_cast<void*>(buf), len, offset, buf_index
+            , std::move(handler)};
+}
+
+}
+
+IoEngine::IoEngine(unsigned entries, Backend backend)
+    : impl_(create_engine(entries, backend))
+{
+}
+
+IoEngine::IoEngine(IoEngine &&src)
+    : impl_(std::move(src.impl_))
+{
+}
+
+IoEngine::~IoEngine()
+{
+}
+
+IoEngine::Backend IoEngine::backend() const
+{
+    return impl_->backend();
+}
+
+void IoEngine::read(int fd, void *buf, size_t len, handler_type handler
+                    , off_t offset)
+{
+    impl_->add(mk_op(ReadOp, fd, buf, len, offset, 0, std::move(handler)));
+}
+
+void IoEngine::write(int fd, void const *buf, size_t len
+                     , handler_type handler, off_t offset)
+{
+    impl_->add(mk_op(WriteOp, fd, buf, len, offset, 0, std::move(handler)));
+}
+
+void IoEngine::register_buffers(std::vector<iovec> const &buffers)
+{
+    impl_->register_buffers(buffers);
+}
+
+void IoEngine::read_fixed(int fd, unsigned index, void *buf, size_t len
+                          , handler_type handler, off_t offset)
+{
+    impl_->add(mk_op(ReadFixedOp, fd, buf, len, offset, index
+                     , std::move(handler)));
+}
+
+void IoEngine::write_fixed(int fd, unsigned index, void const *buf
+                           , size_t len, handler_type handler, off_t offset)
+{
+    impl_->add(mk_op(WriteFixedOp, fd, buf, len, offset, index
+                     , std::move(handler)));
+}
+
+size_t IoEngine::submit()
+{
+    return impl_->submit();
+}
+
+size_t IoEngine::run_once(int timeout_msec)
+{
+    return impl_->run_once(timeout_msec);
+}
+
+size_t IoEngine::pending() const
+{
+    return impl_->pending();
+}
+
+int IoEngine::fd() const
+{
+    return impl_->fd();
+}
+
+}
@@ -1,176 +1,1761 @@
 #include <cor/util.hpp>
 #include <cor/mt.hpp>
 #include <deque>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <cerrno>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <iostream>
+#include <cxxabi.h>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 namespace cor
 {
 
-Mutex::WLock::WLock(Mutex const &m) : lock_(m.l_)
+Mutex::WLock::WLock(Mutex const &m) : lock_(m.l_)
+{
+}
+
+Mutex::WLock::WLock(WLock &&from)
+    : lock_(std::move(from.lock_))
+{
+}
+
+Mutex::WLock::~WLock()
+{
+}
+
+void Mutex::WLock::unlock()
+{
+    lock_.unlock();
+}
+
+RWMutex::RWMutex(Policy policy)
+{
+    pthread_rwlockattr_t attr;
+    auto rc = pthread_rwlockattr_init(&attr);
+    if (rc)
+        throw CError(rc, "Can't init rwlock attributes");
+    auto destroy_attr = on_scope_exit([&attr]() {
+            pthread_rwlockattr_destroy(&attr);
+        });
+    rc = pthread_rwlockattr_setkind_np
+        (&attr, (policy == PreferWriters
+                 ? PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+                 : PTHREAD_RWLOCK_PREFER_READER_NP));
+    if (rc)
+        throw CError(rc, "Can't set rwlock kind");
+    rc = pthread_rwlock_init(&l_, &attr);
+    if (rc)
+        throw CError(rc, "Can't init rwlock");
+}
+
+RWMutex::~RWMutex()
+{
+    // fails only if lock is held, nothing can be done in destructor
+    pthread_rwlock_destroy(&l_);
+}
+
+/// failed unlock means lock is not held by the caller, lock
+/// destructors terminate the process then
+static void rwlock_unlock(pthread_rwlock_t &l)
+{
+    auto rc = pthread_rwlock_unlock(&l);
+    if (rc)
+        throw CError(rc, "Can't unlock rwlock");
+}
+
+RWMutex::WLock::WLock(RWMutex const &m) : m_(&m)
+{
+    auto rc = pthread_rwlock_wrlock(&m_->l_);
+    if (rc)
+        throw CError(rc, "Can't lock rwlock for writing");
+}
+
+RWMutex::WLock::WLock(WLock &&from) : m_(from.m_)
+{
+    from.m_ = nullptr;
+}
+
+void RWMutex::WLock::unlock()
+{
+    if (m_) {
+        auto m = m_;
+        m_ = nullptr;
+        rwlock_unlock(m->l_);
+    }
+}
+
+RWMutex::RLock::RLock(RWMutex const &m) : m_(&m)
+{
+    auto rc = pthread_rwlock_rdlock(&m_->l_);
+    if (rc)
+        throw CError(rc, "Can't lock rwlock for reading");
+}
+
+RWMutex::RLock::RLock(RLock &&from) : m_(from.m_)
+{
+    from.m_ = nullptr;
+}
+
+void RWMutex::RLock::unlock()
+{
+    if (m_) {
+        auto m = m_;
+        m_ = nullptr;
+        rwlock_unlock(m->l_);
+    }
+}
+
+ScalableRWMutex::ScalableRWMutex()
+    : readers_(nullptr)
+    , readers_count_(std::max(std::thread::hardware_concurrency(), 1u))
+    , is_writing_(false)
+{
+    void *p = nullptr;
+    auto rc = ::posix_memalign(&p, alignof(Counter)
+                               , readers_count_ * sizeof(Counter));
+    if (rc)
+        throw CError(rc, "Can't allocate rwlock counters");
+    readers_ = static_cast<Counter*>(p);
+    for (size_t i = 0; i < readers_count_; ++i)
+        new (&readers_[i]) Counter();
+}
+
+ScalableRWMutex::~ScalableRWMutex()
+{
+    // counters are trivially destructible
+    ::free(readers_);
+}
+
+ScalableRWMutex::WLock::WLock(ScalableRWMutex const &m) : m_(&m)
+{
+    m_->writer_.lock();
+    m_->is_writing_ = true;
+    // readers are incrementing counter before checking is_writing_,
+    // writer does the same in the opposite order
+    for (size_t i = 0; i < m_->readers_count_; ++i) {
+        while (m_->readers_[i].value.load())
+            std::this_thread::yield();
+    }
+}
+
+ScalableRWMutex::WLock::WLock(WLock &&from) : m_(from.m_)
+{
+    from.m_ = nullptr;
+}
+
+void ScalableRWMutex::WLock::unlock()
+{
+    if (m_) {
+        m_->is_writing_ = false;
+        m_->writer_.unlock();
+        m_ = nullptr;
+    }
+}
+
+ScalableRWMutex::RLock::RLock(ScalableRWMutex const &m) : m_(&m)
+{
+    auto cpu = ::sched_getcpu();
+    auto pos = (cpu < 0 ? 0 : cpu) % m_->readers_count_;
+    counter_ = &m_->readers_[pos].value;
+    while (true) {
+        ++*counter_;
+        if (!m_->is_writing_)
+            break;
+        // wait until writer is done
+        --*counter_;
+        std::lock_guard<std::mutex> wait(m_->writer_);
+    }
+}
+
+ScalableRWMutex::RLock::RLock(RLock &&from)
+    : m_(from.m_), counter_(from.counter_)
+{
+    from.m_ = nullptr;
+}
+
+void ScalableRWMutex::RLock::unlock()
+{
+    if (m_) {
+        --*counter_;
+        m_ = nullptr;
+    }
+}
+
+namespace futex {
+
+namespace {
+
+long futex(std::atomic<int> &word, int op, int value
+           , struct timespec const *timeout)
+{
+    static_assert(sizeof(std::atomic<int>) == sizeof(int)
+                  , "atomic<int> can't be used as futex");
+    return ::syscall(SYS_futex, reinterpret_cast<int*>(&word), op, value
+                     , timeout, nullptr, 0);
+}
+
+}
+
+bool wait(std::atomic<int> &word, int expected)
+{
+    futex(word, FUTEX_WAIT_PRIVATE, expected, nullptr);
+    return true;
+}
+
+bool wait_until(std::atomic<int> &word, int expected
+                , std::chrono::steady_clock::time_point deadline)
+{
+    using namespace std::chrono;
+    auto timeout = duration_cast<nanoseconds>
+        (deadline - steady_clock::now()).count();
+    if (timeout <= 0)
+        return false;
+
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000000000;
+    ts.tv_nsec = timeout % 1000000000;
+    // FUTEX_WAIT timeout is relative and measured by CLOCK_MONOTONIC
+    auto rc = futex(word, FUTEX_WAIT_PRIVATE, expected, &ts);
+    return !(rc < 0 && errno == ETIMEDOUT);
+}
+
+void wake(std::atomic<int> &word, int count)
+{
+    futex(word, FUTEX_WAKE_PRIVATE, count, nullptr);
+}
+
+void wake_all(std::atomic<int> &word)
+{
+    wake(word, std::numeric_limits<int>::max());
+}
+
+}
+
+void BasicCondition::wait()
+{
+    while (true) {
+        int state = state_.load();
+        if (state == Done)
+            return;
+        if (state == Waiting
+            && !state_.compare_exchange_weak(state, Sleeping))
+            continue;
+        futex::wait(state_, Sleeping);
+    }
+}
+
+std::cv_status BasicCondition::wait_until
+(std::chrono::steady_clock::time_point deadline)
+{
+    while (true) {
+        int state = state_.load();
+        if (state == Done)
+            return std::cv_status::no_timeout;
+        if (state == Waiting
+            && !state_.compare_exchange_weak(state, Sleeping))
+            continue;
+        if (!futex::wait_until(state_, Sleeping, deadline))
+            return (state_ == Done
+                    ? std::cv_status::no_timeout
+                    : std::cv_status::timeout);
+    }
+}
+
+void Completion::up()
+{
+    state_ += counter_step;
+}
+
+void Completion::down()
+{
+    if ((state_ -= counter_step) == has_waiters) {
+        // waiters are setting the flag again if counter is increased
+        // before they are woken up
+        state_ &= ~has_waiters;
+        futex::wake_all(state_);
+    }
+}
+
+void Completion::wait()
+{
+    wait_until(nullptr);
+}
+
+bool Completion::wait_until(std::chrono::steady_clock::time_point const *deadline)
+{
+    while (true) {
+        int state = state_.load();
+        if (state < counter_step)
+            return true;
+        if (!(state & has_waiters)
+            && !state_.compare_exchange_weak(state, state | has_waiters))
+            continue;
+        state |= has_waiters;
+        if (!deadline)
+            futex::wait(state_, state);
+        else if (!futex::wait_until(state_, state, *deadline))
+            return state_.load() < counter_step;
+    }
+}
+
+CpuSet CpuSet::allowed()
+{
+    return get_affinity();
+}
+
+std::vector<unsigned> CpuSet::cpus() const
+{
+    std::vector<unsigned> res;
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (contains(cpu))
+            res.push_back(cpu);
+    return res;
+}
+
+void set_affinity(CpuSet const &cpus)
+{
+    if (::sched_setaffinity(0, sizeof(cpu_set_t), &cpus.native()) < 0)
+        throw CError(errno, "Can't set affinity");
+}
+
+CpuSet get_affinity()
+{
+    cpu_set_t res;
+    if (::sched_getaffinity(0, sizeof(res), &res) < 0)
+        throw CError(errno, "Can't get affinity");
+    CpuSet cpus;
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &res))
+            cpus.add(cpu);
+    return cpus;
+}
+
+namespace numa
+{
+
+namespace {
+
+/// parse sysfs list like "0-3,8,10-11"
+std::vector<unsigned> read_list(std::string const &path)
+{
+    std::vector<unsigned> res;
+    std::ifstream in(path.c_str());
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        unsigned first, last;
+        auto count = std::sscanf(item.c_str(), "%u-%u", &first, &last);
+        if (count < 1)
+            continue;
+        if (count == 1)
+            last = first;
+        for (auto v = first; v <= last; ++v)
+            res.push_back(v);
+    }
+    return res;
+}
+
+}
+
+size_t nodes_count()
+{
+    auto nodes = read_list("/sys/devices/system/node/online");
+    return nodes.empty() ? 1 : nodes.back() + 1;
+}
+
+CpuSet node_cpus(unsigned node)
+{
+    auto cpus = read_list
+        ("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    if (cpus.empty())
+        return node ? CpuSet() : CpuSet::allowed();
+    CpuSet res;
+    for (auto cpu : cpus)
+        res.add(cpu);
+    return res;
+}
+
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const
+{
+    if (!count)
+        return 0;
+    uint64_t target = std::ceil(p / 100 * count);
+    if (!target)
+        target = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= target)
+            return std::min(Histogram::upper_bound(i), max);
+    }
+    return max;
+}
+
+static_assert(std::tuple_size<decltype(HistogramSnapshot::buckets)>::value
+              == Histogram::buckets_count, "Buckets count mismatch");
+
+uint64_t Histogram::upper_bound(unsigned index)
+{
+    if (index < (1 << sub_bits))
+        return index;
+    unsigned shift = (index >> sub_bits) - 1;
+    uint64_t sub = index & ((1 << sub_bits) - 1);
+    uint64_t lower = ((1ULL << sub_bits) | sub) << shift;
+    return lower + ((1ULL << shift) - 1);
+}
+
+HistogramSnapshot Histogram::snapshot() const
+{
+    HistogramSnapshot res;
+    for (unsigned i = 0; i < buckets_count; ++i) {
+        res.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        res.count += res.buckets[i];
+    }
+    res.sum = sum_.load(std::memory_order_relaxed);
+    res.max = max_.load(std::memory_order_relaxed);
+    return res;
+}
+
+void Histogram::reset()
+{
+    for (auto &v : buckets_)
+        v.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+struct TaskNode
+{
+    TaskNode() : next(nullptr), enqueued(0) {}
+
+    TaskNode *next;
+    // enqueue time in ns if stats are enabled
+    uint64_t enqueued;
+    Task task;
+};
+
+namespace {
+
+/// task nodes are reused to avoid allocation per enqueued task. Freed
+/// nodes are pushed into the shared lock-free stack, producer takes
+/// the whole stack into the thread-local cache when it runs out of
+/// nodes, so there is no ABA problem. Free nodes over the limit are
+/// returned to the heap, so memory is not kept at the peak of tasks
+/// in flight
+class TaskNodePool
+{
+public:
+    static TaskNode *alloc(Task &&task)
+    {
+        auto &cache = local();
+        auto res = cache.head;
+        if (!res) {
+            cache.flush();
+            res = shared_.exchange(nullptr, std::memory_order_acquire);
+        }
+        if (res) {
+            cache.head = res->next;
+            res->next = nullptr;
+            // free nodes counter is updated in batches to avoid
+            // contention
+            if (++cache.taken == flush_batch)
+                cache.flush();
+        } else {
+            res = new TaskNode();
+        }
+        res->task = std::move(task);
+        res->enqueued = 0;
+        return res;
+    }
+
+    /// release chain of count nodes from begin to end
+    static void release(TaskNode *begin, TaskNode *end, size_t count)
+    {
+        // limit is checked approximately, concurrent releases can
+        // exceed it a bit
+        if (free_.load(std::memory_order_relaxed) + count > max_free) {
+            for (auto p = begin; p; ) {
+                std::unique_ptr<TaskNode> node(p);
+                p = (p == end ? nullptr : p->next);
+            }
+            return;
+        }
+        free_.fetch_add(count, std::memory_order_relaxed);
+        push(begin, end);
+    }
+
+private:
+    static const size_t max_free = 4096;
+    static const size_t flush_batch = 64;
+
+    static void push(TaskNode *begin, TaskNode *end)
+    {
+        auto head = shared_.load(std::memory_order_relaxed);
+        do {
+            end->next = head;
+        } while (!shared_.compare_exchange_weak
+                 (head, begin, std::memory_order_release
+                  , std::memory_order_relaxed));
+    }
+
+    struct Cache
+    {
+        Cache() : head(nullptr), taken(0) {}
+        ~Cache()
+        {
+            flush();
+            if (!head)
+                return;
+            // cached nodes are still counted as free
+            auto end = head;
+            while (end->next)
+                end = end->next;
+            push(head, end);
+        }
+
+        void flush()
+        {
+            if (!taken)
+                return;
+            free_.fetch_sub(taken, std::memory_order_relaxed);
+            taken = 0;
+        }
+
+        TaskNode *head;
+        // nodes taken from the cache, not subtracted from free_ yet
+        size_t taken;
+    };
+
+    static Cache &local()
+    {
+        static thread_local Cache cache;
+        return cache;
+    }
+
+    static std::atomic<TaskNode*> shared_;
+    // nodes in the shared stack and thread caches
+    static std::atomic<size_t> free_;
+};
+
+std::atomic<TaskNode*> TaskNodePool::shared_(nullptr);
+std::atomic<size_t> TaskNodePool::free_(0);
+
+uint64_t now_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>
+        (steady_clock::now().time_since_epoch()).count();
+}
+
+/// exceptions are not propagated from fire-and-forget tasks, they
+/// are logged
+void call(Task &task)
+{
+    try {
+        error_trace_msg_nothrow("Task: ", [&task]() { task(); });
+    } catch (abi::__forced_unwind &) {
+        // thread cancellation should not be stopped
+        throw;
+    } catch (...) {
+        std::cerr << "Task: unknown exception" << std::endl;
+    }
+}
+
+void execute(Task &task)
+{
+    call(task);
+    task.reset();
+}
+
+}
+
+struct TimerInbox;
+
+struct TimerEntry
+{
+    enum State { Scheduled, Cancelled, Fired };
+
+    TimerEntry(Task &&task, TaskQueue::clock_type::time_point at
+               , uint64_t period, std::weak_ptr<TimerInbox> const &inbox)
+        : prev(nullptr), next(nullptr), level(-1), slot(0)
+        , expires(0), period(period), at(at)
+        , task(std::move(task)), state(Scheduled)
+        , cancel_next(nullptr), inbox(inbox)
+    {}
+
+    // members below are accessed only from the queue thread
+    TimerEntry *prev;
+    TimerEntry *next;
+    // wheel level, -1 if entry is not in the wheel
+    int level;
+    unsigned slot;
+    // in wheel ticks
+    uint64_t expires;
+    uint64_t period;
+    TaskQueue::clock_type::time_point at;
+    Task task;
+    // reference held while entry is in the wheel
+    std::shared_ptr<TimerEntry> self;
+
+    std::atomic<int> state;
+    TimerEntry *cancel_next;
+    std::shared_ptr<TimerEntry> cancel_ref;
+    std::weak_ptr<TimerInbox> inbox;
+};
+
+/// cancelled timers are passed to the queue thread through the
+/// lock-free stack to be removed from the wheel
+struct TimerInbox
+{
+    TimerInbox() : cancelled(nullptr) {}
+
+    ~TimerInbox()
+    {
+        for (auto p = take(); p; ) {
+            auto ref = std::move(p->cancel_ref);
+            p = p->cancel_next;
+        }
+    }
+
+    void push(std::shared_ptr<TimerEntry> const &entry)
+    {
+        entry->cancel_ref = entry;
+        auto head = cancelled.load(std::memory_order_relaxed);
+        do {
+            entry->cancel_next = head;
+        } while (!cancelled.compare_exchange_weak(head, entry.get()));
+    }
+
+    TimerEntry *take()
+    {
+        return cancelled.load(std::memory_order_relaxed)
+            ? cancelled.exchange(nullptr, std::memory_order_acquire)
+            : nullptr;
+    }
+
+    std::atomic<TimerEntry*> cancelled;
+};
+
+bool Timer::cancel()
+{
+    if (!entry_)
+        return false;
+
+    int state = TimerEntry::Scheduled;
+    if (!entry_->state.compare_exchange_strong(state, TimerEntry::Cancelled))
+        return false;
+
+    auto inbox = entry_->inbox.lock();
+    if (inbox)
+        inbox->push(entry_);
+    return true;
+}
+
+bool Timer::is_active() const
+{
+    return entry_ && entry_->state == TimerEntry::Scheduled;
+}
+
+namespace {
+
+/// hierarchical timer wheel with cascading: entries expiring during
+/// the next 64 ticks are put into the level 0 slots, each next level
+/// slot covers 64 slots of the previous level. Insertion and removal
+/// are O(1), bitmaps of occupied slots are used to find the next
+/// expiration time without walking over empty ticks
+class TimerWheel
+{
+public:
+    enum { level_bits = 6, slots_count = 1 << level_bits, levels_count = 6 };
+
+    typedef TaskQueue::clock_type clock_type;
+
+    TimerWheel()
+        : origin_(clock_type::now()), now_(0), size_(0), occupied_(), slots_()
+    {}
+
+    ~TimerWheel();
+
+    size_t size() const { return size_; }
+    uint64_t now() const { return now_; }
+
+    /// round up, timer should not fire earlier
+    uint64_t tick(clock_type::time_point t) const
+    {
+        using namespace std::chrono;
+        if (t <= origin_)
+            return 0;
+        auto d = t - origin_;
+        auto res = duration_cast<milliseconds>(d);
+        return res.count() + (res < d ? 1 : 0);
+    }
+
+    uint64_t current_tick() const
+    {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(clock_type::now() - origin_).count();
+    }
+
+    clock_type::time_point time(uint64_t tick) const
+    {
+        return origin_ + std::chrono::milliseconds(tick);
+    }
+
+    /// entry expiration tick should be already set
+    void add(TimerEntry *e)
+    {
+        if (e->expires <= now_)
+            e->expires = now_ + 1;
+        insert(e);
+    }
+
+    void remove(TimerEntry *);
+
+    bool next_expiry(uint64_t &) const;
+
+    /// calls fn for each expired entry already removed from the wheel
+    template <typename FnT>
+    void advance(uint64_t, FnT const &);
+
+private:
+    void insert(TimerEntry *);
+    TimerEntry *detach(unsigned level, unsigned slot);
+    void cascade(unsigned level);
+
+    clock_type::time_point origin_;
+    uint64_t now_;
+    size_t size_;
+    uint64_t occupied_[levels_count];
+    TimerEntry *slots_[levels_count][slots_count];
+};
+
+TimerWheel::~TimerWheel()
+{
+    for (unsigned l = 0; l < levels_count; ++l) {
+        for (unsigned i = 0; i < slots_count; ++i) {
+            for (auto p = detach(l, i); p; ) {
+                auto ref = std::move(p->self);
+                p = p->next;
+            }
+        }
+    }
+}
+
+void TimerWheel::insert(TimerEntry *e)
+{
+    static const uint64_t max_delta
+        = (uint64_t)1 << (level_bits * levels_count);
+    auto delta = e->expires - now_;
+    auto expires = e->expires;
+    unsigned level = 0;
+    while (level < levels_count - 1
+           && delta >= ((uint64_t)1 << (level_bits * (level + 1))))
+        ++level;
+    // it will be cascaded and reinserted until close enough
+    if (delta >= max_delta)
+        expires = now_ + max_delta - 1;
+    unsigned slot = (expires >> (level_bits * level)) & (slots_count - 1);
+
+    auto &head = slots_[level][slot];
+    e->prev = nullptr;
+    e->next = head;
+    if (head)
+        head->prev = e;
+    head = e;
+    e->level = level;
+    e->slot = slot;
+    occupied_[level] |= (uint64_t)1 << slot;
+    ++size_;
+}
+
+void TimerWheel::remove(TimerEntry *e)
+{
+    if (e->level < 0)
+        return;
+
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        slots_[e->level][e->slot] = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    if (!slots_[e->level][e->slot])
+        occupied_[e->level] &= ~((uint64_t)1 << e->slot);
+    e->prev = e->next = nullptr;
+    e->level = -1;
+    --size_;
+}
+
+TimerEntry *TimerWheel::detach(unsigned level, unsigned slot)
+{
+    auto res = slots_[level][slot];
+    slots_[level][slot] = nullptr;
+    occupied_[level] &= ~((uint64_t)1 << slot);
+    for (auto p = res; p; p = p->next) {
+        p->level = -1;
+        --size_;
+    }
+    return res;
+}
+
+void TimerWheel::cascade(unsigned level)
+{
+    auto slot = (now_ >> (level_bits * level)) & (slots_count - 1);
+    if (!slot && level + 1 < levels_count)
+        cascade(level + 1);
+    for (auto p = detach(level, slot); p; ) {
+        auto next = p->next;
+        insert(p);
+        p = next;
+    }
+}
+
+bool TimerWheel::next_expiry(uint64_t &res) const
+{
+    bool is_found = false;
+    for (unsigned l = 0; l < levels_count; ++l) {
+        if (!occupied_[l])
+            continue;
+        auto shift = level_bits * l;
+        auto base = now_ >> shift;
+        // rotate to start from the slot after the current one
+        auto start = (base + 1) & (slots_count - 1);
+        auto bits = occupied_[l];
+        if (start)
+            bits = (bits >> start) | (bits << (slots_count - start));
+        uint64_t tick = (base + __builtin_ctzll(bits) + 1) << shift;
+        if (!is_found || tick < res)
+            res = tick;
+        is_found = true;
+    }
+    return is_found;
+}
+
+template <typename FnT>
+void TimerWheel::advance(uint64_t tick, FnT const &fn)
+{
+    while (now_ < tick) {
+        uint64_t next;
+        if (!next_expiry(next) || next > tick) {
+            now_ = tick;
+            break;
+        }
+        // nothing happens on skipped ticks
+        now_ = next;
+        auto slot = now_ & (slots_count - 1);
+        if (!slot)
+            cascade(1);
+        for (auto p = detach(0, slot); p; ) {
+            auto next = p->next;
+            p->prev = p->next = nullptr;
+            fn(p);
+            p = next;
+        }
+    }
+}
+
+}
+
+/// TaskQueue is a multiple producers/single consumer queue. There is
+/// a lane per priority, producers are pushing tasks into the lane
+/// lock-free stack, consumer takes the whole stack at once and appends
+/// it to the lane list in the reversed (FIFO) order. Consumer is
+/// parked on the condition only if there is no tasks, it is woken up
+/// only by the producer pushing task into the empty stack.
+///
+/// Lanes are scheduled using credits: the highest priority lane with
+/// pending tasks and credits left is selected, credits are refilled
+/// with lane weights when all lanes with pending tasks are out of
+/// credits. So high priority tasks are executed first while lower
+/// priority lanes are still getting their share
+class TaskQueueImpl
+{
+public:
+    typedef TaskQueue::Priority Priority;
+
+    TaskQueueImpl(CpuSet const * = nullptr);
+    ~TaskQueueImpl();
+
+    bool enqueue(Task, Priority);
+    bool enqueue(TaskBatch &&, Priority);
+    Timer enqueue_at(TaskQueue::clock_type::time_point, Task, uint64_t);
+    void stop();
+    void join();
+    bool empty() const;
+    size_t depth(Priority p) const { return lanes_[p].size; }
+    void enable_stats(bool v) { is_stats_enabled_ = v; }
+    TaskQueue::Stats stats() const;
+
+private:
+    typedef TaskNode Node;
+
+    struct Lane
+    {
+        Lane() : head(nullptr), size(0), first(nullptr), last(nullptr)
+               , credits(0)
+        {}
+
+        std::atomic<Node*> head;
+        std::atomic<size_t> size;
+        // taken tasks, accessed only from the queue thread
+        Node *first;
+        Node *last;
+        unsigned credits;
+    };
+
+    enum {
+        lanes_count = TaskQueue::priorities_count,
+        // max tasks executed before checking timers
+        max_round = 64
+    };
+
+    static unsigned const weights[lanes_count];
+
+    void push(Lane &, Node *, Node *, size_t);
+    void take(Lane &);
+    Lane *select();
+    void loop();
+    bool process();
+    bool has_tasks() const;
+    void wait();
+    void remove_cancelled();
+    bool expire_timers();
+    void fire(TimerEntry *);
+
+    std::atomic<bool> is_running_;
+    Lane lanes_[lanes_count];
+    // set by the consumer before parking
+    std::atomic<bool> is_sleeping_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    // accessed only from the queue thread
+    TimerWheel timers_;
+    std::shared_ptr<TimerInbox> cancelled_;
+    std::atomic<bool> is_stats_enabled_;
+    // updated only by the queue thread
+    std::atomic<uint64_t> executed_;
+    std::atomic<uint64_t> idle_ns_;
+    // start of the current wait if stats are enabled
+    std::atomic<uint64_t> idle_since_;
+    Histogram latency_;
+    Histogram run_time_;
+    std::thread thread_;
+};
+
+TaskBatch::TaskBatch(TaskBatch &&from)
+    : head_(from.head_), tail_(from.tail_), size_(from.size_)
+{
+    from.head_ = from.tail_ = nullptr;
+    from.size_ = 0;
+}
+
+TaskBatch::~TaskBatch()
+{
+    if (!head_)
+        return;
+    for (auto p = head_; p; p = p->next)
+        p->task.reset();
+    TaskNodePool::release(head_, tail_, size_);
+}
+
+void TaskBatch::push(Task task)
+{
+    auto node = TaskNodePool::alloc(std::move(task));
+    node->next = head_;
+    head_ = node;
+    if (!tail_)
+        tail_ = node;
+    ++size_;
+}
+
+TaskQueue::TaskQueue()
+    : impl_(cor::make_unique<TaskQueueImpl>())
+{
+}
+
+TaskQueue::TaskQueue(CpuSet const &affinity)
+    : impl_(cor::make_unique<TaskQueueImpl>(&affinity))
 {
 }
 
-Mutex::WLock::WLock(WLock &&from)
-    : lock_(std::move(from.lock_))
+TaskQueue::TaskQueue(TaskQueue &&src)
+    : impl_(std::move(src.impl_))
 {
 }
 
-Mutex::WLock::~WLock()
+TaskQueue::~TaskQueue()
 {
 }
 
-void Mutex::WLock::unlock()
+void TaskQueue::stop()
 {
-    lock_.unlock();
+    impl_->stop();
 }
 
-void Completion::up()
+void TaskQueue::join()
+{
+    impl_->join();
+}
+
+bool TaskQueue::empty() const
+{
+    return impl_->empty();
+}
+
+size_t TaskQueue::depth(Priority priority) const
+{
+    return impl_->depth(priority);
+}
+
+void TaskQueue::enable_stats(bool is_enabled)
+{
+    impl_->enable_stats(is_enabled);
+}
+
+TaskQueue::Stats TaskQueue::stats() const
+{
+    return impl_->stats();
+}
+
+double TaskQueue::Stats::throughput(Stats const &prev) const
+{
+    std::chrono::duration<double> elapsed = time - prev.time;
+    return elapsed.count() > 0
+        ? (executed - prev.executed) / elapsed.count()
+        : 0;
+}
+
+bool TaskQueue::enqueue(Task task)
+{
+    return impl_->enqueue(std::move(task), Normal);
+}
+
+bool TaskQueue::enqueue(Task task, Priority priority)
+{
+    return impl_->enqueue(std::move(task), priority);
+}
+
+bool TaskQueue::enqueue(std::packaged_task<void()> task)
+{
+    return impl_->enqueue(Task(std::move(task)), Normal);
+}
+
+bool TaskQueue::enqueue_bulk(TaskBatch &&batch, Priority priority)
+{
+    return impl_->enqueue(std::move(batch), priority);
+}
+
+Timer TaskQueue::enqueue_at(clock_type::time_point at, Task task)
+{
+    return impl_->enqueue_at(at, std::move(task), 0);
+}
+
+Timer TaskQueue::enqueue_periodic(std::chrono::milliseconds period, Task task)
+{
+    uint64_t ticks = period.count() > 0 ? period.count() : 1;
+    return impl_->enqueue_at(clock_type::now() + period, std::move(task), ticks);
+}
+
+unsigned const TaskQueueImpl::weights[] = { 8, 4, 1 };
+
+TaskQueueImpl::TaskQueueImpl(CpuSet const *affinity)
+    : is_running_(true)
+    , is_sleeping_(false)
+    , cancelled_(std::make_shared<TimerInbox>())
+    , is_stats_enabled_(false)
+    , executed_(0)
+    , idle_ns_(0)
+    , idle_since_(0)
+    , thread_(std::bind(&TaskQueueImpl::loop, this))
+{
+    if (!affinity)
+        return;
+    auto rc = pthread_setaffinity_np(thread_.native_handle()
+                                     , sizeof(cpu_set_t), &affinity->native());
+    if (rc) {
+        stop();
+        join();
+        throw CError(rc, "Can't set queue thread affinity");
+    }
+}
+
+TaskQueueImpl::~TaskQueueImpl()
+{
+    stop();
+    join();
+    // tasks enqueued after the queue is stopped are never executed
+    for (auto &lane : lanes_) {
+        take(lane);
+        for (auto p = lane.first; p; ) {
+            std::unique_ptr<Node> node(p);
+            p = p->next;
+        }
+    }
+}
+
+void TaskQueueImpl::stop()
 {
+    if (!is_running_.exchange(false))
+        return;
+
     std::lock_guard<std::mutex> lock(mutex_);
-    ++counter_;
+    ready_.notify_one();
 }
 
-void Completion::down()
+void TaskQueueImpl::join()
 {
-    std::unique_lock<std::mutex> lock(mutex_);
-    --counter_;
-    if (!counter_) {
-        lock.unlock();
-        done_.notify_one();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+bool TaskQueueImpl::empty() const
+{
+    for (auto const &lane : lanes_)
+        if (lane.size)
+            return false;
+    return true;
+}
+
+bool TaskQueueImpl::enqueue(Task task, Priority priority)
+{
+    if (!is_running_)
+        return false;
+
+    auto node = TaskNodePool::alloc(std::move(task));
+    if (is_stats_enabled_.load(std::memory_order_relaxed))
+        node->enqueued = now_ns();
+    push(lanes_[priority], node, node, 1);
+    return true;
+}
+
+bool TaskQueueImpl::enqueue(TaskBatch &&batch, Priority priority)
+{
+    if (!is_running_)
+        return false;
+
+    if (batch.head_) {
+        if (is_stats_enabled_.load(std::memory_order_relaxed)) {
+            auto now = now_ns();
+            for (auto p = batch.head_; p; p = p->next)
+                p->enqueued = now;
+        }
+        push(lanes_[priority], batch.head_, batch.tail_, batch.size_);
+        batch.head_ = batch.tail_ = nullptr;
+        batch.size_ = 0;
     }
+    return true;
 }
 
-void Completion::wait()
+/// push chain of nodes linked in the reversed order
+void TaskQueueImpl::push(Lane &lane, Node *first, Node *last, size_t count)
 {
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (!counter_)
+    lane.size += count;
+    auto head = lane.head.load(std::memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!lane.head.compare_exchange_weak(head, first));
+
+    // if the stack was not empty consumer is running or it was
+    // already woken up by the producer pushed the first task. Stack
+    // head is updated before is_sleeping_ is checked while consumer
+    // does the same in the opposite order, so wakeup can't be lost
+    if (!head && is_sleeping_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_.notify_one();
+    }
+}
+
+/// append pushed tasks to the lane list
+void TaskQueueImpl::take(Lane &lane)
+{
+    if (!lane.head.load(std::memory_order_relaxed))
         return;
 
-    done_.wait(lock);
+    auto p = lane.head.exchange(nullptr, std::memory_order_acquire);
+    Node *first = nullptr;
+    auto last = p;
+    while (p) {
+        auto next = p->next;
+        p->next = first;
+        first = p;
+        p = next;
+    }
+    if (lane.last)
+        lane.last->next = first;
+    else
+        lane.first = first;
+    lane.last = last;
 }
 
-class TaskQueueImpl
+TaskQueueImpl::Lane *TaskQueueImpl::select()
+{
+    Lane *pending = nullptr;
+    for (auto &lane : lanes_) {
+        take(lane);
+        if (!lane.first)
+            continue;
+        if (lane.credits)
+            return &lane;
+        if (!pending)
+            pending = &lane;
+    }
+    if (pending) {
+        for (unsigned i = 0; i < lanes_count; ++i)
+            lanes_[i].credits = weights[i];
+    }
+    return pending;
+}
+
+/// timer is added to the wheel by the task executed in the queue
+/// thread
+Timer TaskQueueImpl::enqueue_at
+(TaskQueue::clock_type::time_point at, Task task, uint64_t period)
+{
+    if (!is_running_)
+        return Timer();
+
+    auto entry = std::make_shared<TimerEntry>
+        (std::move(task), at, period, cancelled_);
+    // timers should not be delayed by the normal priority tasks
+    auto is_queued = enqueue([this, entry]() {
+            if (entry->state != TimerEntry::Scheduled)
+                return;
+            entry->expires = timers_.tick(entry->at);
+            entry->self = entry;
+            timers_.add(entry.get());
+        }, TaskQueue::High);
+    return is_queued ? Timer(entry) : Timer();
+}
+
+void TaskQueueImpl::loop()
+{
+    while (is_running_) {
+        auto is_processed = process();
+        remove_cancelled();
+        auto is_fired = expire_timers();
+        if (!is_processed && !is_fired)
+            wait();
+    }
+}
+
+void TaskQueueImpl::remove_cancelled()
+{
+    for (auto p = cancelled_->take(); p; ) {
+        auto ref = std::move(p->cancel_ref);
+        p = p->cancel_next;
+        if (ref->level >= 0) {
+            timers_.remove(ref.get());
+            ref->self.reset();
+        }
+    }
+}
+
+bool TaskQueueImpl::expire_timers()
+{
+    if (!timers_.size())
+        return false;
+
+    auto tick = timers_.current_tick();
+    if (tick <= timers_.now())
+        return false;
+
+    auto size = timers_.size();
+    timers_.advance(tick, [this](TimerEntry *e) { fire(e); });
+    return size != timers_.size();
+}
+
+/// entry is already removed from the wheel
+void TaskQueueImpl::fire(TimerEntry *e)
+{
+    auto ref = std::move(e->self);
+    if (!e->period) {
+        int state = TimerEntry::Scheduled;
+        if (e->state.compare_exchange_strong(state, TimerEntry::Fired))
+            execute(e->task);
+        return;
+    }
+    if (e->state != TimerEntry::Scheduled)
+        return;
+
+    call(e->task);
+    if (e->state != TimerEntry::Scheduled)
+        return;
+
+    // missed periods are skipped
+    e->expires = std::max(e->expires + e->period, timers_.now() + 1);
+    e->self = std::move(ref);
+    timers_.add(e);
+}
+
+bool TaskQueueImpl::process()
+{
+    unsigned count = 0;
+    Node *done = nullptr, *done_last = nullptr;
+    auto is_measured = is_stats_enabled_.load(std::memory_order_relaxed);
+    // end of the previous task is the start of the next one, so clock
+    // is read once per task
+    auto now = is_measured ? now_ns() : 0;
+    for (; count < max_round; ++count) {
+        auto lane = select();
+        if (!lane)
+            break;
+
+        auto node = lane->first;
+        lane->first = node->next;
+        if (!lane->first)
+            lane->last = nullptr;
+        --lane->credits;
+        if (is_measured) {
+            // enqueue time is taken in other thread and can be later
+            if (node->enqueued)
+                latency_.record(now > node->enqueued
+                                ? now - node->enqueued : 0);
+            execute(node->task);
+            auto end = now_ns();
+            run_time_.record(end - now);
+            now = end;
+        } else {
+            execute(node->task);
+        }
+        --lane->size;
+        node->next = done;
+        done = node;
+        if (!done_last)
+            done_last = node;
+    }
+    if (done)
+        TaskNodePool::release(done, done_last, count);
+    if (count)
+        executed_.fetch_add(count, std::memory_order_relaxed);
+    return count;
+}
+
+bool TaskQueueImpl::has_tasks() const
+{
+    for (auto const &lane : lanes_)
+        if (lane.head.load())
+            return true;
+    return false;
+}
+
+void TaskQueueImpl::wait()
+{
+    auto begin = is_stats_enabled_.load(std::memory_order_relaxed)
+        ? now_ns() : 0;
+    idle_since_.store(begin, std::memory_order_relaxed);
+    auto update_idle = on_scope_exit([this, begin]() {
+            if (!begin)
+                return;
+            idle_since_.store(0, std::memory_order_relaxed);
+            idle_ns_.fetch_add(now_ns() - begin, std::memory_order_relaxed);
+        });
+    std::unique_lock<std::mutex> lock(mutex_);
+    is_sleeping_ = true;
+    auto is_ready = [this]() { return !is_running_ || has_tasks(); };
+    uint64_t tick;
+    if (timers_.next_expiry(tick))
+        ready_.wait_until(lock, timers_.time(tick), is_ready);
+    else
+        ready_.wait(lock, is_ready);
+    is_sleeping_ = false;
+}
+
+TaskQueue::Stats TaskQueueImpl::stats() const
+{
+    using namespace std::chrono;
+    TaskQueue::Stats res;
+    res.time = TaskQueue::clock_type::now();
+    for (unsigned i = 0; i < lanes_count; ++i)
+        res.depth[i] = lanes_[i].size;
+    res.executed = executed_.load(std::memory_order_relaxed);
+    auto idle = idle_ns_.load(std::memory_order_relaxed);
+    // including the current wait
+    auto since = idle_since_.load(std::memory_order_relaxed);
+    auto now = now_ns();
+    if (since && now > since)
+        idle += now - since;
+    res.idle = duration_cast<TaskQueue::clock_type::duration>
+        (nanoseconds(idle));
+    res.latency = latency_.snapshot();
+    res.run_time = run_time_.snapshot();
+    return res;
+}
+
+class ThreadPoolImpl
 {
 public:
-    TaskQueueImpl();
-    ~TaskQueueImpl();
+    ThreadPoolImpl(size_t, ThreadPool::Placement, CpuSet const &);
+    ~ThreadPoolImpl();
 
-    bool enqueue(std::packaged_task<void()>);
+    bool enqueue(Task);
     void stop();
-    void join() { thread_.join(); }
-    bool empty() const;
+    void join();
+    bool empty() const { return !pending_; }
+    size_t size() const { return workers_.size(); }
 
 private:
+    typedef Task task_type;
 
-    void loop();
-    void process();
+    struct Placement
+    {
+        bool is_pinned;
+        CpuSet affinity;
+        unsigned node;
+    };
 
-    bool is_running_;
-    std::deque<std::packaged_task<void()> > tasks_;
-    mutable std::mutex mutex_;
-    mutable std::condition_variable ready_;
-    std::thread thread_;
+    /// allocated by the worker thread after it is pinned, so the
+    /// worker state and the task ring are in node-local memory. Tasks
+    /// are put into the ring, so small callables are stored in
+    /// node-local memory too, the overflow deque is allocated by
+    /// producers
+    struct Worker
+    {
+        Worker() : ring(ring_size), head(0), size(0) {}
+
+        void push(task_type &&);
+        bool pop_front(task_type &);
+        bool pop_back(task_type &);
+
+        std::mutex mutex;
+        std::vector<task_type> ring;
+        size_t head;
+        size_t size;
+        // tasks following the ring ones
+        std::deque<task_type> overflow;
+        // workers of the same node are tried first
+        std::vector<size_t> victims;
+    };
+
+    static const size_t ring_size = 256;
+
+    static std::vector<Placement> place
+    (size_t, ThreadPool::Placement, CpuSet const &);
+    void start(size_t, Placement const &);
+    void loop(size_t);
+    bool pop(size_t, task_type &);
+    bool steal(size_t, task_type &);
+    void wake();
+
+    std::vector<Placement> placement_;
+    std::vector<std::unique_ptr<Worker> > workers_;
+    std::vector<std::thread> threads_;
+    Completion started_;
+    std::atomic<int> affinity_error_;
+    std::atomic<bool> is_running_;
+    // number of tasks enqueued but not taken by workers yet
+    std::atomic<size_t> pending_;
+    std::atomic<size_t> sleeping_;
+    std::atomic<size_t> next_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+
+    static __thread ThreadPoolImpl *current_pool_;
+    static __thread size_t current_worker_;
 };
 
-TaskQueue::TaskQueue()
-    : impl_(cor::make_unique<TaskQueueImpl>())
+__thread ThreadPoolImpl *ThreadPoolImpl::current_pool_ = nullptr;
+__thread size_t ThreadPoolImpl::current_worker_ = 0;
+
+ThreadPool::ThreadPool(size_t workers)
+    : impl_(cor::make_unique<ThreadPoolImpl>(workers, Unbound, CpuSet()))
 {
 }
 
-TaskQueue::TaskQueue(TaskQueue &&src)
+ThreadPool::ThreadPool(size_t workers, Placement placement
+                       , CpuSet const &cpus)
+    : impl_(cor::make_unique<ThreadPoolImpl>(workers, placement, cpus))
+{
+}
+
+ThreadPool::ThreadPool(ThreadPool &&src)
     : impl_(std::move(src.impl_))
 {
 }
 
-TaskQueue::~TaskQueue()
+ThreadPool::~ThreadPool()
 {
 }
 
-void TaskQueue::stop()
+void ThreadPool::stop()
 {
     impl_->stop();
 }
 
-void TaskQueue::join()
+void ThreadPool::join()
 {
     impl_->join();
 }
 
-bool TaskQueue::empty() const
+bool ThreadPool::empty() const
 {
     return impl_->empty();
 }
 
-bool TaskQueue::enqueue(std::packaged_task<void()> task)
+size_t ThreadPool::size() const
+{
+    return impl_->size();
+}
+
+bool ThreadPool::enqueue(Task task)
 {
     return impl_->enqueue(std::move(task));
 }
 
-TaskQueueImpl::TaskQueueImpl()
-    : is_running_(true)
-    , thread_(std::bind(&TaskQueueImpl::loop, this))
-{}
+bool ThreadPool::enqueue(std::packaged_task<void()> task)
+{
+    return impl_->enqueue(Task(std::move(task)));
+}
 
-TaskQueueImpl::~TaskQueueImpl()
+ThreadPoolImpl::ThreadPoolImpl
+(size_t count, ThreadPool::Placement placement, CpuSet const &cpus)
+    : placement_(place(count ? count : 1, placement, cpus))
+    , workers_(placement_.size())
+    , affinity_error_(0)
+    , is_running_(true)
+    , pending_(0)
+    , sleeping_(0)
+    , next_(0)
 {
-    stop();
-    join();
+    count = placement_.size();
+    for (size_t i = 0; i < count; ++i)
+        started_.up();
+    threads_.reserve(count);
+    try {
+        for (size_t i = 0; i < count; ++i)
+            threads_.emplace_back(&ThreadPoolImpl::loop, this, i);
+    } catch (...) {
+        // destructor is not called, started workers should be joined,
+        // they wait until all workers are started. Pool is stopped
+        // first, so they exit w/o touching absent workers
+        stop();
+        for (size_t i = threads_.size(); i < count; ++i)
+            started_.down();
+        join();
+        throw;
+    }
+    started_.wait();
+    if (affinity_error_) {
+        stop();
+        join();
+        throw CError(affinity_error_, "Can't set worker affinity");
+    }
 }
 
-void TaskQueueImpl::stop()
+std::vector<ThreadPoolImpl::Placement> ThreadPoolImpl::place
+(size_t count, ThreadPool::Placement placement, CpuSet const &cpus)
 {
-    if (!is_running_)
-        return;
+    std::vector<Placement> res;
+    res.reserve(count);
+    if (placement == ThreadPool::Unbound) {
+        for (size_t i = 0; i < count; ++i)
+            res.push_back(Placement{false, CpuSet(), 0});
+        return res;
+    }
 
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (!is_running_)
-        return;
+    std::vector<CpuSet> nodes;
+    for (size_t i = 0; i < numa::nodes_count(); ++i)
+        nodes.push_back(numa::node_cpus(i) & cpus);
 
-    is_running_ = false;
-    lock.unlock();
-    ready_.notify_one();
+    if (placement == ThreadPool::PinCpus) {
+        auto ids = cpus.cpus();
+        if (ids.empty())
+            throw Error("No CPUs to pin workers");
+        for (size_t i = 0; i < count; ++i) {
+            auto cpu = ids[i % ids.size()];
+            unsigned node = 0;
+            while (node < nodes.size() && !nodes[node].contains(cpu))
+                ++node;
+            res.push_back(Placement{true, CpuSet{cpu}
+                        , node < nodes.size() ? node : 0});
+        }
+        return res;
+    }
+
+    std::vector<unsigned> used;
+    for (unsigned node = 0; node < nodes.size(); ++node)
+        if (!nodes[node].empty())
+            used.push_back(node);
+    if (used.empty())
+        throw Error("No NUMA node CPUs to place workers");
+    for (size_t i = 0; i < count; ++i) {
+        auto node = used[i % used.size()];
+        res.push_back(Placement{true, nodes[node], node});
+    }
+    return res;
 }
 
-bool TaskQueueImpl::empty() const
+void ThreadPoolImpl::Worker::push(task_type &&task)
 {
-    std::lock_guard<std::mutex> l(mutex_);
-    return tasks_.empty();
+    if (overflow.empty() && size < ring.size())
+        ring[(head + size++) % ring.size()] = std::move(task);
+    else
+        overflow.push_back(std::move(task));
 }
 
-bool TaskQueueImpl::enqueue(std::packaged_task<void()> task)
+bool ThreadPoolImpl::Worker::pop_front(task_type &dst)
 {
-    if (!is_running_)
+    if (!size)
         return false;
+    dst = std::move(ring[head]);
+    head = (head + 1) % ring.size();
+    --size;
+    // overflow tasks are moved into the ring, keeping the order
+    if (!overflow.empty()) {
+        ring[(head + size++) % ring.size()] = std::move(overflow.front());
+        overflow.pop_front();
+    }
+    return true;
+}
 
-    std::unique_lock<std::mutex> lock(mutex_);
+bool ThreadPoolImpl::Worker::pop_back(task_type &dst)
+{
+    if (!overflow.empty()) {
+        dst = std::move(overflow.back());
+        overflow.pop_back();
+        return true;
+    }
+    if (!size)
+        return false;
+    dst = std::move(ring[(head + --size) % ring.size()]);
+    return true;
+}
+
+void ThreadPoolImpl::start(size_t pos, Placement const &placement)
+{
+    if (placement.is_pinned
+        && ::sched_setaffinity(0, sizeof(cpu_set_t)
+                               , &placement.affinity.native()) < 0)
+        affinity_error_ = errno;
+
+    // allocation after pinning places the worker into node-local memory
+    auto worker = cor::make_unique<Worker>();
+    auto count = placement_.size();
+    for (size_t i = 1; i < count; ++i) {
+        auto victim = (pos + i) % count;
+        if (placement_[victim].node == placement.node)
+            worker->victims.push_back(victim);
+    }
+    for (size_t i = 1; i < count; ++i) {
+        auto victim = (pos + i) % count;
+        if (placement_[victim].node != placement.node)
+            worker->victims.push_back(victim);
+    }
+    workers_[pos] = std::move(worker);
+
+    // workers steal from each other, so all queues should be created
+    started_.down();
+    started_.wait();
+}
+
+ThreadPoolImpl::~ThreadPoolImpl()
+{
+    stop();
+    join();
+}
+
+void ThreadPoolImpl::stop()
+{
+    if (!is_running_.exchange(false))
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ready_.notify_all();
+}
+
+void ThreadPoolImpl::join()
+{
+    for (auto &t : threads_)
+        if (t.joinable())
+            t.join();
+}
+
+bool ThreadPoolImpl::enqueue(task_type task)
+{
     if (!is_running_)
         return false;
 
-    tasks_.push_back(std::move(task));
-    lock.unlock();
+    // worker puts tasks into own queue, other threads are distributing
+    // them round-robin
+    auto pos = (current_pool_ == this
+                ? current_worker_
+                : next_.fetch_add(1, std::memory_order_relaxed))
+        % workers_.size();
+    auto &w = *workers_[pos];
+    ++pending_;
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.push(std::move(task));
+    }
+    // pending_ is increased before sleeping_ is checked while worker
+    // does the same in the opposite order, so wakeup can't be lost
+    if (sleeping_)
+        wake();
+    return true;
+}
 
+void ThreadPoolImpl::wake()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
     ready_.notify_one();
-    return true;
 }
 
-void TaskQueueImpl::loop()
+bool ThreadPoolImpl::pop(size_t pos, task_type &dst)
 {
-    while (is_running_) {
-        process();
-        std::unique_lock<std::mutex> lock(mutex_);
-        ready_.wait(lock, [this]() { return !is_running_ || !tasks_.empty(); });
+    auto &w = *workers_[pos];
+    std::lock_guard<std::mutex> lock(w.mutex);
+    return w.pop_front(dst);
+}
+
+bool ThreadPoolImpl::steal(size_t pos, task_type &dst)
+{
+    for (auto victim : workers_[pos]->victims) {
+        // worker thread was not created
+        if (!workers_[victim])
+            continue;
+        auto &w = *workers_[victim];
+        std::unique_lock<std::mutex> lock(w.mutex, std::try_to_lock);
+        // owner takes from the front, so stealing from the back
+        // reduces contention
+        if (lock.owns_lock() && w.pop_back(dst))
+            return true;
     }
+    return false;
 }
 
-void TaskQueueImpl::process()
+void ThreadPoolImpl::loop(size_t pos)
 {
-    while (tasks_.size()) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        if (tasks_.size()) {
-            std::packaged_task<void()> task = std::move(tasks_.front());
-            tasks_.pop_front();
-            lock.unlock();
-            task();
+    start(pos, placement_[pos]);
+    current_pool_ = this;
+    current_worker_ = pos;
+    task_type task;
+    while (is_running_) {
+        if (pop(pos, task) || steal(pos, task)) {
+            --pending_;
+            execute(task);
+            continue;
         }
+        if (pending_) {
+            // stealing can miss tasks of busy (locked) queues
+            std::this_thread::yield();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++sleeping_;
+        ready_.wait(lock, [this]() { return !is_running_ || pending_; });
+        --sleeping_;
     }
 }
 
@@ -0,0 +1,48 @@
+#include <cor/notlisp.hpp>
+
+namespace cor
+{
+namespace notlisp
+{
+
+expr_ptr mk_dict(expr_list_type const &params)
+{
+    ListAccessor src(params);
+    Dict::map_type items;
+    items.reserve(params.size() / 2);
+    rest_dict(src, items, [](expr_ptr const &) {
+            throw Error("Dict accepts only keyword arguments");
+        });
+    return std::make_shared<Dict>(std::move(items));
+}
+
+namespace {
+
+expr_ptr dict_get(env_ptr, expr_list_type &params)
+{
+    ListAccessor src(params);
+    auto dict = src.required<Dict>();
+    if (!dict)
+        throw Error("dict-get: dict is expected");
+    auto key = src.required();
+    if (!key || (key->type() != Expr::Keyword
+                 && key->type() != Expr::String))
+        throw Error("dict-get: keyword or string key is expected");
+    auto res = dict->get(key->value());
+    return res ? res : mk_nil();
+}
+
+}
+
+std::vector<Env::item_type> dict_records()
+{
+    return {
+        mk_record("dict", [](env_ptr, expr_list_type &params) {
+                return mk_dict(params);
+            }),
+        mk_record("dict-get", &dict_get)
+    };
+}
+
+} // notlisp
+} // cor
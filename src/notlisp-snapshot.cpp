@@ -0,0 +1,384 @@
+#include <cor/notlisp.hpp>
+#include <cor/util.hpp>
+
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#include <stdexcept>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+namespace cor
+{
+namespace notlisp
+{
+
+namespace {
+
+char const snapshot_magic[8] = {'n', 'l', 's', 'n', 'a', 'p', '0', '1'};
+
+enum Tag : uint8_t {
+    NilTag,
+    IntegerTag,
+    RealTag,
+    StringTag,
+    KeywordTag,
+    SymbolTag,
+    ListTag,
+    LongVectorTag,
+    RealVectorTag,
+    DictTag
+};
+
+/// FNV-1a
+uint64_t source_hash(std::string const &src)
+{
+    uint64_t res = 14695981039346656037ULL;
+    for (unsigned char c : src) {
+        res ^= c;
+        res *= 1099511628211ULL;
+    }
+    return res;
+}
+
+class Writer
+{
+public:
+    template <typename T>
+    void pod(T v)
+    {
+        data_.append(reinterpret_cast<char const*>(&v), sizeof(v));
+    }
+
+    void raw(void const *p, size_t len)
+    {
+        data_.append(reinterpret_cast<char const*>(p), len);
+    }
+
+    void bytes(void const *p, size_t len)
+    {
+        pod<uint32_t>(len);
+        raw(p, len);
+    }
+
+    void str(std::string const &s) { bytes(s.data(), s.size()); }
+
+    template <typename T>
+    void vector(Tag tag, std::vector<T> const &v)
+    {
+        pod(tag);
+        bytes(v.data(), v.size() * sizeof(T));
+    }
+
+    void expr(expr_ptr const &);
+
+    std::string const& data() const { return data_; }
+
+private:
+    std::string data_;
+};
+
+void Writer::expr(expr_ptr const &e)
+{
+    if (!e) {
+        pod(NilTag);
+        return;
+    }
+
+    switch (e->expr_class()) {
+    case Expr::BasicClass:
+        switch (e->type()) {
+        case Expr::Nil: pod(NilTag); return;
+        case Expr::String: pod(StringTag); str(e->value()); return;
+        case Expr::Keyword: pod(KeywordTag); str(e->value()); return;
+        default: break;
+        }
+        break;
+    case Expr::PodClass:
+        if (e->type() == Expr::Integer) {
+            pod(IntegerTag);
+            pod<int64_t>((long)*e);
+        } else {
+            pod(RealTag);
+            pod<double>((double)*e);
+        }
+        return;
+    case Expr::SymbolClass:
+        pod(SymbolTag);
+        str(e->value());
+        return;
+    case Expr::ListClass: {
+        auto const &items = static_cast<List const&>(*e).items;
+        pod(ListTag);
+        pod<uint32_t>(items.size());
+        for (auto const &v : items)
+            expr(v);
+        return;
+    }
+    case Expr::LongVectorClass:
+        vector(LongVectorTag, static_cast<Vector<long> const&>(*e).items);
+        return;
+    case Expr::RealVectorClass:
+        vector(RealVectorTag, static_cast<Vector<double> const&>(*e).items);
+        return;
+    case Expr::DictClass: {
+        auto const &items = static_cast<Dict const&>(*e).items;
+        pod(DictTag);
+        pod<uint32_t>(items.size());
+        for (auto const &v : items) {
+            str(v.first);
+            expr(v.second);
+        }
+        return;
+    }
+    default:
+        break;
+    }
+    throw Error("Can't save %s to snapshot", e->value().c_str());
+}
+
+class Reader
+{
+public:
+    Reader(char const *begin, char const *end)
+        : cur_(begin), end_(end)
+    {}
+
+    char const *raw(size_t len)
+    {
+        if ((size_t)(end_ - cur_) < len)
+            throw Error("Snapshot is truncated");
+        auto res = cur_;
+        cur_ += len;
+        return res;
+    }
+
+    template <typename T>
+    T pod()
+    {
+        T res;
+        std::memcpy(&res, raw(sizeof(res)), sizeof(res));
+        return res;
+    }
+
+    std::string str()
+    {
+        auto len = pod<uint32_t>();
+        return std::string(raw(len), len);
+    }
+
+    template <typename T>
+    std::vector<T> vector()
+    {
+        auto len = pod<uint32_t>();
+        if (len % sizeof(T))
+            throw Error("Broken vector in snapshot");
+        // length is checked before allocation
+        auto src = raw(len);
+        std::vector<T> res(len / sizeof(T));
+        std::memcpy(res.data(), src, len);
+        return res;
+    }
+
+    /// count of items taking at least min_size bytes each, it is
+    /// checked against the rest of data, so broken count does not
+    /// cause huge allocation
+    uint32_t count(size_t min_size)
+    {
+        auto res = pod<uint32_t>();
+        if ((size_t)(end_ - cur_) / min_size < res)
+            throw Error("Broken count in snapshot");
+        return res;
+    }
+
+    expr_ptr expr();
+
+    bool at_end() const { return cur_ == end_; }
+
+private:
+    char const *cur_;
+    char const *end_;
+};
+
+expr_ptr Reader::expr()
+{
+    switch (pod<Tag>()) {
+    case NilTag:
+        return mk_nil();
+    case IntegerTag:
+        return mk_value(static_cast<long>(pod<int64_t>()));
+    case RealTag:
+        return mk_value(pod<double>());
+    case StringTag:
+        return mk_string(str());
+    case KeywordTag:
+        return mk_keyword(str());
+    case SymbolTag:
+        return mk_symbol(str());
+    case ListTag: {
+        auto count = this->count(sizeof(Tag));
+        expr_list_type items;
+        for (uint32_t i = 0; i < count; ++i)
+            items.push_back(expr());
+        return mk_list(std::move(items));
+    }
+    case LongVectorTag: {
+        std::vector<long> items;
+        for (auto v : vector<int64_t>())
+            items.push_back(v);
+        return mk_vector(std::move(items));
+    }
+    case RealVectorTag:
+        return mk_vector(vector<double>());
+    case DictTag: {
+        auto count = this->count(sizeof(uint32_t) + sizeof(Tag));
+        Dict::map_type items;
+        items.reserve(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            auto key = str();
+            items[key] = expr();
+        }
+        return std::make_shared<Dict>(std::move(items));
+    }
+    }
+    throw Error("Unknown tag in snapshot");
+}
+
+}
+
+void save_snapshot(std::string const &path, std::string const &source,
+                   expr_list_type const &results)
+{
+    static_assert(sizeof(long) <= sizeof(int64_t), "Unexpected long size");
+
+    Writer out;
+    out.raw(snapshot_magic, sizeof(snapshot_magic));
+    out.pod(source_hash(source));
+    out.pod<uint32_t>(results.size());
+    for (auto const &v : results)
+        out.expr(v);
+
+    // write to the temporary file first to replace snapshot atomically
+    auto tmp_path = path + ".tmp";
+    cor::FdHandle fd(::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC
+                            | O_CLOEXEC, 0644));
+    if (!fd.is_valid())
+        throw CError(errno, "Can't create snapshot");
+
+    auto const &data = out.data();
+    size_t done = 0;
+    while (done < data.size()) {
+        auto rc = ::write(fd.value(), data.data() + done, data.size() - done);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            auto err = errno;
+            ::unlink(tmp_path.c_str());
+            throw CError(err, "Can't write snapshot");
+        }
+        done += rc;
+    }
+    // data should reach the disk before rename, otherwise empty or
+    // truncated snapshot can be found under the final name after
+    // power loss
+    if (::fsync(fd.value()) < 0) {
+        auto err = errno;
+        ::unlink(tmp_path.c_str());
+        throw CError(err, "Can't sync snapshot");
+    }
+    fd.close();
+    if (::rename(tmp_path.c_str(), path.c_str()) < 0) {
+        auto err = errno;
+        ::unlink(tmp_path.c_str());
+        throw CError(err, "Can't rename snapshot");
+    }
+
+    // make rename durable
+    auto pos = path.rfind('/');
+    auto dir_path = (pos == std::string::npos
+                     ? std::string(".")
+                     : path.substr(0, pos ? pos : 1));
+    cor::FdHandle dir(::open(dir_path.c_str(), O_RDONLY | O_DIRECTORY
+                             | O_CLOEXEC));
+    if (!dir.is_valid() || ::fsync(dir.value()) < 0)
+        throw CError(errno, "Can't sync snapshot directory");
+}
+
+bool load_snapshot(std::string const &path, std::string const &source,
+                   expr_list_type &dst)
+{
+    cor::FdHandle fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd.is_valid())
+        return false;
+
+    struct stat st;
+    if (::fstat(fd.value(), &st) < 0 || !st.st_size)
+        return false;
+
+    size_t size = st.st_size;
+    auto p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.value(), 0);
+    if (p == MAP_FAILED)
+        return false;
+    auto unmap = on_scope_exit([p, size]() { ::munmap(p, size); });
+
+    auto begin = static_cast<char const*>(p);
+    try {
+        Reader in(begin, begin + size);
+        auto magic = in.raw(sizeof(snapshot_magic));
+        if (std::memcmp(magic, snapshot_magic, sizeof(snapshot_magic))
+            || in.pod<uint64_t>() != source_hash(source))
+            return false;
+
+        auto count = in.count(sizeof(Tag));
+        expr_list_type res;
+        for (uint32_t i = 0; i < count; ++i)
+            res.push_back(in.expr());
+        if (!in.at_end())
+            return false;
+        dst = std::move(res);
+    } catch (Error const &) {
+        return false;
+    } catch (std::bad_alloc const &) {
+        return false;
+    } catch (std::length_error const &) {
+        return false;
+    }
+    return true;
+}
+
+expr_list_type eval_snapshot(env_ptr env, std::string const &source,
+                             std::string const &snapshot_path,
+                             snapshot_error_handler_type on_save_error)
+{
+    expr_list_type res;
+    if (load_snapshot(snapshot_path, source, res))
+        return res;
+
+    Interpreter interpreter(env);
+    std::istringstream in(source);
+    cor::sexp::parse(in, interpreter);
+    res = interpreter.results();
+    try {
+        save_snapshot(snapshot_path, source, res);
+    } catch (cor::Error const &e) {
+        if (!on_save_error)
+            throw;
+        on_save_error(e);
+    } catch (std::bad_alloc const &e) {
+        if (!on_save_error)
+            throw;
+        on_save_error(Error("Can't save snapshot: %s", e.what()));
+    } catch (std::length_error const &e) {
+        if (!on_save_error)
+            throw;
+        on_save_error(Error("Can't save snapshot: %s", e.what()));
+    }
+    return res;
+}
+
+} // notlisp
+} // cor
@@ -0,0 +1,225 @@
+#include <cor/notlisp.hpp>
+
+#include <numeric>
+
+namespace cor
+{
+namespace notlisp
+{
+
+namespace {
+
+template <typename T> T number_cast(Expr const &);
+
+template <>
+long number_cast<long>(Expr const &v)
+{
+    if (v.type() != Expr::Integer)
+        throw Error("Integer vector item is expected, got type %d", v.type());
+    return (long)v;
+}
+
+template <>
+double number_cast<double>(Expr const &v)
+{
+    if (v.type() == Expr::Integer)
+        return (double)(long)v;
+    if (v.type() != Expr::Real)
+        throw Error("Numeric vector item is expected, got type %d", v.type());
+    return (double)v;
+}
+
+template <typename T>
+void items_to_vector(expr_list_type const &src, std::vector<T> &dst)
+{
+    dst.clear();
+    dst.reserve(src.size());
+    for (auto const &v : src) {
+        if (!v)
+            throw Error("Null vector item");
+        dst.push_back(number_cast<T>(*v));
+    }
+}
+
+/// call fn with items of long or double vector
+template <typename FnT>
+expr_ptr with_vector(expr_ptr const &e, FnT const &fn)
+{
+    if (e && e->expr_class() == Expr::LongVectorClass)
+        return fn(static_cast<Vector<long> const&>(*e).items);
+    if (e && e->expr_class() == Expr::RealVectorClass)
+        return fn(static_cast<Vector<double> const&>(*e).items);
+    throw Error("Vector is expected");
+}
+
+struct Sum
+{
+    template <typename T>
+    expr_ptr operator ()(std::vector<T> const &v) const
+    {
+        return mk_value(std::accumulate(v.begin(), v.end(), T(0)));
+    }
+};
+
+template <bool IsMin>
+struct MinMax
+{
+    template <typename T>
+    expr_ptr operator ()(std::vector<T> const &v) const
+    {
+        if (v.empty())
+            throw Error("Empty vector has no min/max");
+        auto p = IsMin
+            ? std::min_element(v.begin(), v.end())
+            : std::max_element(v.begin(), v.end());
+        return mk_value(*p);
+    }
+};
+
+struct Scale
+{
+    Scale(expr_ptr const &k) : k(k) {}
+
+    expr_ptr operator ()(std::vector<long> const &v) const
+    {
+        if (k->type() != Expr::Integer)
+            return scale(v, number_cast<double>(*k));
+
+        long f = (long)*k;
+        std::vector<long> res(v.size());
+        for (size_t i = 0; i < v.size(); ++i)
+            res[i] = v[i] * f;
+        return mk_vector(std::move(res));
+    }
+
+    expr_ptr operator ()(std::vector<double> const &v) const
+    {
+        return scale(v, number_cast<double>(*k));
+    }
+
+    template <typename T>
+    static expr_ptr scale(std::vector<T> const &v, double f)
+    {
+        std::vector<double> res(v.size());
+        for (size_t i = 0; i < v.size(); ++i)
+            res[i] = v[i] * f;
+        return mk_vector(std::move(res));
+    }
+
+    expr_ptr k;
+};
+
+expr_ptr mk_vector_fn(env_ptr, expr_list_type &params)
+{
+    bool is_integer = std::all_of
+        (params.begin(), params.end(), [](expr_ptr const &v) {
+            return v && v->type() == Expr::Integer;
+        });
+    if (is_integer) {
+        std::vector<long> res;
+        items_to_vector(params, res);
+        return mk_vector(std::move(res));
+    }
+    std::vector<double> res;
+    items_to_vector(params, res);
+    return mk_vector(std::move(res));
+}
+
+expr_ptr vector_sum(env_ptr, expr_list_type &params)
+{
+    ListAccessor src(params);
+    return with_vector(src.required(), Sum());
+}
+
+expr_ptr vector_min(env_ptr, expr_list_type &params)
+{
+    ListAccessor src(params);
+    return with_vector(src.required(), MinMax<true>());
+}
+
+expr_ptr vector_max(env_ptr, expr_list_type &params)
+{
+    ListAccessor src(params);
+    return with_vector(src.required(), MinMax<false>());
+}
+
+expr_ptr vector_scale(env_ptr, expr_list_type &params)
+{
+    ListAccessor src(params);
+    auto v = src.required();
+    auto k = src.required();
+    if (!k)
+        throw Error("Scale factor is null");
+    return with_vector(v, Scale(k));
+}
+
+expr_ptr vector_dot(env_ptr, expr_list_type &params)
+{
+    ListAccessor src(params);
+    auto a = src.required();
+    auto b = src.required();
+    auto la = expr_cast<Vector<long> >(a);
+    auto lb = expr_cast<Vector<long> >(b);
+    if (la && lb) {
+        if (la->items.size() != lb->items.size())
+            throw Error("Vectors sizes are different");
+        return mk_value(std::inner_product(la->items.begin(), la->items.end(),
+                                           lb->items.begin(), 0L));
+    }
+
+    std::vector<double> va, vb;
+    to_vector(a, va);
+    to_vector(b, vb);
+    if (va.size() != vb.size())
+        throw Error("Vectors sizes are different");
+    return mk_value(std::inner_product(va.begin(), va.end(),
+                                       vb.begin(), 0.0));
+}
+
+}
+
+template <typename T>
+void to_vector(expr_ptr const &expr, std::vector<T> &dst)
+{
+    if (!expr)
+        throw Error("to_vector. Null expression");
+
+    switch (expr->expr_class()) {
+    case Expr::LongVectorClass: {
+        auto const &v = static_cast<Vector<long> const&>(*expr).items;
+        dst.assign(v.begin(), v.end());
+        break;
+    }
+    case Expr::RealVectorClass: {
+        if (VectorTraits<T>::expr_class != Expr::RealVectorClass)
+            throw Error("to_vector. Can't convert reals to integers");
+        auto const &v = static_cast<Vector<double> const&>(*expr).items;
+        dst.assign(v.begin(), v.end());
+        break;
+    }
+    case Expr::ListClass:
+        items_to_vector(static_cast<List const&>(*expr).items, dst);
+        break;
+    default:
+        throw Error("to_vector. Vector or list is expected, got %s",
+                    expr->value().c_str());
+    }
+}
+
+template void to_vector<long>(expr_ptr const &, std::vector<long> &);
+template void to_vector<double>(expr_ptr const &, std::vector<double> &);
+
+std::vector<Env::item_type> vector_records()
+{
+    return {
+        mk_record("vector", &mk_vector_fn),
+        mk_record("vector-sum", &vector_sum),
+        mk_record("vector-min", &vector_min),
+        mk_record("vector-max", &vector_max),
+        mk_record("vector-scale", &vector_scale),
+        mk_record("vector-dot", &vector_dot)
+    };
+}
+
+} // notlisp
+} // cor
@@ -1,6 +1,12 @@
 #include <cor/notlisp.hpp>
 #include <cor/sexp_impl.hpp>
 
+#include <cor/mt.hpp>
+
+#include <cstdlib>
+#include <atomic>
+#include <condition_variable>
+
 namespace cor {
 namespace sexp {
 
@@ -14,6 +20,84 @@ namespace cor
 namespace notlisp
 {
 
+__thread unsigned long exprs_created
+__attribute__((tls_model("initial-exec"))) = 0;
+
+/// budget of the current evaluation, null if there is no limits
+static __thread Budget *active_budget
+__attribute__((tls_model("initial-exec"))) = nullptr;
+
+namespace {
+
+/// makes budget active in the scope. If budget is null, budget of
+/// the enclosing evaluation (if any) is kept active
+class BudgetScope
+{
+public:
+    BudgetScope(Budget *budget)
+        : before_(active_budget)
+    {
+        if (budget)
+            active_budget = budget;
+    }
+
+    ~BudgetScope() { active_budget = before_; }
+
+private:
+    Budget *before_;
+};
+
+class DepthScope
+{
+public:
+    DepthScope(Budget *budget)
+        : budget_(budget)
+    {
+        if (budget_)
+            budget_->enter();
+    }
+
+    ~DepthScope()
+    {
+        if (budget_)
+            budget_->leave();
+    }
+
+private:
+    Budget *budget_;
+};
+
+char const *limit_name(LimitExceeded::Limit l)
+{
+    switch (l) {
+    case LimitExceeded::Steps: return "steps";
+    case LimitExceeded::Depth: return "depth";
+    case LimitExceeded::Allocations: return "allocations";
+    }
+    return "?";
+}
+
+}
+
+Limits Budget::rest() const
+{
+    // zero means no limit, so at least 1 is left, usage is checked
+    // by add() anyway
+    auto rest = [](unsigned long limit, unsigned long used) {
+        return !limit ? 0 : (used < limit ? limit - used : 1);
+    };
+    Limits res;
+    res.steps = rest(limits.steps, steps_);
+    res.depth = rest(limits.depth, depth_);
+    res.allocs = rest(limits.allocs, exprs());
+    return res;
+}
+
+LimitExceeded::LimitExceeded(Limit l, unsigned long max)
+    : Error("Evaluation limit exceeded: %s > %lu", limit_name(l), max)
+    , limit(l)
+{}
+
 expr_ptr mk_string(std::string const &s)
 {
     return mk_basic_expr<Expr::String>(s);
@@ -34,24 +118,27 @@ expr_ptr mk_symbol(std::string const &s)
     return expr_ptr(new SymbolExpr(s));
 }
 
-expr_ptr mk_lambda(std::string const &name, lambda_type const &fn)
+expr_ptr mk_lambda(std::string const &name, lambda_type const &fn,
+                   ParamsEval params_eval)
 {
-    return expr_ptr(new LambdaExpr(name, fn));
+    return expr_ptr(new LambdaExpr(name, fn, params_eval));
 }
 
 expr_ptr eval(env_ptr env, expr_ptr src)
 {
+    if (active_budget)
+        active_budget->step();
     return src ? src->do_eval(env, src) : mk_nil();
 }
 
-static void must_have_type(expr_ptr expr, Expr::Type t,
-                           std::string const &failure_msg)
+void must_have_type(expr_ptr const &expr, Expr::Type t,
+                    char const *failure_msg)
 {
     if (!expr)
-        throw Error(failure_msg + ". Null expression");
+        throw Error(std::string(failure_msg) + ". Null expression");
     if (expr->type() != t)
         throw Error
-            ((failure_msg + ". expr %s: need type %d, got %d").c_str(),
+            ((std::string(failure_msg) + ". expr %s: need type %d, got %d").c_str(),
              expr->value().c_str(), t, expr->type());
 }
 
@@ -122,21 +209,67 @@ expr_ptr default_atom_convert(std::string &&s)
 
 Interpreter::Interpreter(env_ptr env, atom_converter_type atom_converter)
     : env(env),
-      stack({expr_list_type()}),
+      stack(1),
+      depth(1),
       convert_atom(atom_converter)
 {
 }
 
+void Interpreter::reset()
+{
+    for (size_t i = 0; i < depth; ++i)
+        stack[i].clear();
+    depth = 1;
+    if (budget)
+        budget->reset();
+}
+
+void Interpreter::eval_batch(std::vector<std::string> const &inputs,
+                             batch_handler_type handler)
+{
+    eval_batch(inputs, std::move(handler), batch_error_handler_type());
+}
+
+void Interpreter::eval_batch(std::vector<std::string> const &inputs,
+                             batch_handler_type handler,
+                             batch_error_handler_type on_error)
+{
+    std::istringstream in;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        reset();
+        in.str(inputs[i]);
+        in.clear();
+        try {
+            cor::sexp::parse(in, *this);
+        } catch (cor::Error const &e) {
+            if (!on_error)
+                throw;
+            on_error(i, e);
+            continue;
+        }
+        handler(i, stack[depth - 1]);
+    }
+}
+
 void Interpreter::on_atom(std::string &&s)
 {
+    BudgetScope scope(budget.get());
     auto v = convert_atom(std::move(s));
-    stack.top().push_back(eval(env, v));
+    push_result(eval(env, v));
 }
 
-void Interpreter::on_list_end()
+void Interpreter::push_result(expr_ptr &&res)
 {
-    auto &t = stack.top();
+    if (on_result && depth == 1)
+        on_result(std::move(res));
+    else
+        stack[depth - 1].push_back(std::move(res));
+}
 
+/// evaluate the first form member, it should be a function. Function
+/// is removed from the form, the rest are parameters
+static expr_ptr form_function(env_ptr const &env, expr_list_type &t)
+{
     if (t.empty())
         throw Error("Evaluation of empty expression");
 
@@ -146,19 +279,642 @@ void Interpreter::on_list_end()
         throw Error("Got null evaluating %s, expecting function",
                          expr->value().c_str());
 
-    if (p->type() != Expr::Function)
+    if (!ExprIs<FunctionExpr>::check(*p))
         throw Error("Not a function, type %d", p->type());
     t.pop_front();
-    expr_ptr res;
+    return p;
+}
+
+/// call the function with evaluated parameters, error is logged
+/// with the function name and rethrown
+static expr_ptr call_function(env_ptr const &env, FunctionExpr &fn,
+                              expr_list_type &&params, Profiler *profiler)
+{
     try {
-        res = static_cast<FunctionExpr&>(*p)(env, eval(env, t));
+        if (!profiler)
+            return fn(env, std::move(params));
+        Profiler::Call call(*profiler, fn.value());
+        return fn(env, std::move(params));
     } catch (cor::Error const &e) {
         std::cerr << "Error '" << e.what() << "' evaluating "
-                  << *p << std::endl;
-        throw e;
+                  << fn << std::endl;
+        throw;
+    }
+}
+
+namespace {
+
+/// function call postponed to be executed concurrently with other
+/// parameters of the Parallel function. It is evaluated to itself,
+/// so it can be a parameter of the deferred Parallel function
+class Deferred : public Expr
+{
+public:
+    Deferred(std::function<expr_ptr ()> &&fn)
+        : Expr("deferred", Expr::Object), fn(std::move(fn))
+    {}
+
+    std::function<expr_ptr ()> fn;
+protected:
+    virtual expr_ptr do_eval(env_ptr, expr_ptr self)
+    {
+        return self;
+    }
+};
+
+ThreadPool &default_executor()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+/// deferred calls of one Parallel function. Call is claimed by the
+/// pool worker or by the waiting thread, so the waiting thread does
+/// not wait for calls which are not started (pool can be busy with
+/// other waiting calls)
+class DeferredCalls
+{
+public:
+    DeferredCalls(size_t count, Budget const *budget)
+        : calls_(count)
+        , has_budget_(budget != nullptr)
+        , pending_(count)
+    {
+        if (budget)
+            limits_ = budget->rest();
+    }
+
+    void set(size_t i, expr_ptr *dst) { calls_[i].dst = dst; }
+
+    void run(size_t i);
+    void wait();
+    /// assign results, \return the first (in parameters order)
+    /// exception
+    std::exception_ptr finish(Budget *);
+
+private:
+    struct Call
+    {
+        Call() : dst(nullptr), is_claimed(false), steps(0), exprs(0) {}
+
+        expr_ptr *dst;
+        std::atomic<bool> is_claimed;
+        expr_ptr res;
+        std::exception_ptr error;
+        unsigned long steps;
+        unsigned long exprs;
+    };
+
+    std::vector<Call> calls_;
+    bool has_budget_;
+    Limits limits_;
+    std::mutex mutex_;
+    std::condition_variable done_;
+    size_t pending_;
+};
+
+void DeferredCalls::run(size_t i)
+{
+    auto &call = calls_[i];
+    if (call.is_claimed.exchange(true))
+        return;
+
+    {
+        std::unique_ptr<Budget> budget;
+        if (has_budget_)
+            budget = cor::make_unique<Budget>(limits_);
+        BudgetScope scope(budget.get());
+        try {
+            call.res = static_cast<Deferred&>(**call.dst).fn();
+        } catch (...) {
+            call.error = std::current_exception();
+        }
+        if (budget) {
+            call.steps = budget->steps();
+            call.exprs = budget->exprs();
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!--pending_)
+        done_.notify_all();
+}
+
+void DeferredCalls::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return !pending_; });
+}
+
+std::exception_ptr DeferredCalls::finish(Budget *budget)
+{
+    std::exception_ptr error;
+    unsigned long steps = 0, exprs = 0;
+    for (auto &call : calls_) {
+        if (call.error && !error)
+            error = call.error;
+        *call.dst = std::move(call.res);
+        steps += call.steps;
+        exprs += call.exprs;
+    }
+    if (!error && budget)
+        budget->add(steps, exprs);
+    return error;
+}
+
+/// execute deferred calls sequentially in the current thread, they
+/// are parameters of the Sequential function nested into the
+/// Parallel one
+void eval_deferred_here(expr_list_type &params)
+{
+    for (auto &v : params) {
+        if (expr_cast<Deferred>(v))
+            v = static_cast<Deferred&>(*v).fn();
+    }
+}
+
+/// execute deferred calls concurrently using the pool (or the
+/// default pool if it is null), the waiting thread executes calls
+/// which are not started yet. All calls are finished before the
+/// first (in parameters order) exception is rethrown
+void eval_deferred(expr_list_type &params, ThreadPool *pool)
+{
+    std::vector<expr_ptr*> deferred;
+    for (auto &v : params) {
+        if (expr_cast<Deferred>(v))
+            deferred.push_back(&v);
+    }
+    if (deferred.empty())
+        return;
+
+    auto budget = active_budget;
+    auto calls = std::make_shared<DeferredCalls>(deferred.size(), budget);
+    for (size_t i = 0; i < deferred.size(); ++i)
+        calls->set(i, deferred[i]);
+
+    auto &executor = pool ? *pool : default_executor();
+    for (size_t i = 0; i + 1 < deferred.size(); ++i)
+        executor.enqueue([calls, i]() { calls->run(i); });
+    for (size_t i = deferred.size(); i > 0; --i)
+        calls->run(i - 1);
+    calls->wait();
+
+    auto error = calls->finish(budget);
+    if (error)
+        std::rethrow_exception(error);
+}
+
+}
+
+bool Interpreter::is_in_parallel() const
+{
+    // stack[0] holds top-level results, forms start from stack[1]
+    for (size_t i = depth - 1; i > 1; --i) {
+        auto const &parent = stack[i - 1];
+        if (parent.empty())
+            continue;
+        auto const &p = parent.front();
+        if (p && ExprIs<FunctionExpr>::check(*p)
+            && (static_cast<FunctionExpr const&>(*p).params_eval()
+                == ParamsEval::Parallel))
+            return true;
+    }
+    return false;
+}
+
+void Interpreter::on_list_end()
+{
+    BudgetScope scope(budget.get());
+    auto &t = stack[depth - 1];
+    auto p = form_function(env, t);
+    expr_ptr res;
+    if (is_in_parallel()) {
+        // nested calls are deferred too, so the whole parameter of the
+        // Parallel function is evaluated by the pool
+        auto params = eval(env, t);
+        auto e = env;
+        auto prof = profiler;
+        auto pool = executor;
+        res = std::make_shared<Deferred>([p, e, params, prof, pool]() mutable {
+                auto &fn = static_cast<FunctionExpr&>(*p);
+                if (fn.params_eval() == ParamsEval::Parallel)
+                    eval_deferred(params, pool.get());
+                else
+                    eval_deferred_here(params);
+                return call_function(e, fn, std::move(params), prof.get());
+            });
+        t.clear();
+        --depth;
+        push_result(std::move(res));
+        return;
+    }
+    auto &fn = static_cast<FunctionExpr&>(*p);
+    // failed deferred call is logged by itself
+    if (fn.params_eval() == ParamsEval::Parallel)
+        eval_deferred(t, executor.get());
+    res = call_function(env, fn, eval(env, t), profiler.get());
+    t.clear();
+    --depth;
+    push_result(std::move(res));
+}
+
+/// the innermost profiled call made by the current thread
+static __thread Profiler::Call *active_call
+__attribute__((tls_model("initial-exec"))) = nullptr;
+
+Profiler::Call::Call(Profiler &p, std::string const &name)
+    : profiler_(p)
+    , name_(name)
+    , begin_(clock_type::now())
+    , nested_(0)
+    , exprs_before_(exprs_created)
+    , caller_(active_call)
+{
+    active_call = this;
+}
+
+Profiler::Call::~Call()
+{
+    auto total = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (clock_type::now() - begin_);
+    profiler_.add(name_, total, total - nested_
+                  , exprs_created - exprs_before_);
+    active_call = caller_;
+    for (auto c = caller_; c; c = c->caller_) {
+        if (&c->profiler_ == &profiler_) {
+            c->nested_ += total;
+            break;
+        }
     }
-    stack.pop();
-    stack.top().push_back(res);
+}
+
+void Profiler::add(std::string const &name, std::chrono::nanoseconds total
+                   , std::chrono::nanoseconds self, unsigned long exprs)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &stat = stats_[name];
+    ++stat.calls;
+    stat.total += total;
+    stat.self += self;
+    stat.exprs += exprs;
+}
+
+Profiler::snapshot_type Profiler::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return snapshot_type(stats_.begin(), stats_.end());
+}
+
+void Profiler::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.clear();
+}
+
+/// literal atoms are parameters of the compiled form, the same check
+/// is used by default_atom_convert()
+static bool is_literal_atom(std::string const &s)
+{
+    if (s.empty() || s[0] == ':')
+        return false;
+
+    char const *begin = s.c_str(), *end = begin + s.size();
+    char *endptr = nullptr;
+    std::strtol(begin, &endptr, 10);
+    if (endptr == end)
+        return true;
+    std::strtod(begin, &endptr);
+    return endptr == end;
+}
+
+namespace {
+
+/// compiled form node
+struct Node
+{
+    enum Kind {
+        Value,
+        Literal,
+        String,
+        Form
+    };
+
+    Node(Kind k, size_t slot) : kind(k), slot(slot) {}
+    Node(expr_ptr const &v) : kind(Value), value(v), slot(0) {}
+
+    Kind kind;
+    expr_ptr value;
+    size_t slot;
+    std::vector<Node> items;
+};
+
+/// parser handler building the shape key of the input and gathering
+/// literal parameters
+class ShapeBuilder
+{
+public:
+    ShapeBuilder(std::string &key, std::vector<std::string> &literals)
+        : key_(key), literals_(literals)
+    {
+        key_.clear();
+        literals_.clear();
+    }
+
+    void on_list_begin() { key_ += '('; }
+    void on_list_end() { key_ += ')'; }
+    void on_comment(std::string &&) { }
+    void on_eof() { }
+
+    void on_string(std::string &&s)
+    {
+        key_ += 's';
+        literals_.push_back(std::move(s));
+    }
+
+    void on_atom(std::string &&s)
+    {
+        if (is_literal_atom(s)) {
+            key_ += 'n';
+            literals_.push_back(std::move(s));
+        } else {
+            key_ += 'a';
+            key_ += std::to_string(s.size());
+            key_ += ':';
+            key_ += s;
+        }
+    }
+
+private:
+    std::string &key_;
+    std::vector<std::string> &literals_;
+};
+
+/// fast path of the parser for the most common inputs: w/o escapes
+/// and well-formed. Calls the same handler methods as
+/// cor::sexp::parse(), \return false if input should be passed to
+/// the full parser, handler state is undefined then
+template <typename HandlerT>
+bool parse_simple(std::string const &src, HandlerT &handler)
+{
+    auto is_space = [](char c) {
+        return ::isspace(static_cast<unsigned char>(c));
+    };
+    unsigned level = 0;
+    auto p = src.begin(), end = src.end();
+    while (p != end) {
+        auto c = *p;
+        if (c == '(') {
+            ++level;
+            handler.on_list_begin();
+            ++p;
+        } else if (c == ')') {
+            if (!level)
+                return false;
+            --level;
+            handler.on_list_end();
+            ++p;
+        } else if (c == ';') {
+            p = std::find(p, end, '\n');
+        } else if (is_space(c)) {
+            ++p;
+        } else if (c == '"') {
+            auto begin = ++p;
+            for (; p != end && *p != '"'; ++p)
+                if (*p == '\\')
+                    return false;
+            if (p == end)
+                return false;
+            handler.on_string(std::string(begin, p++));
+        } else {
+            auto begin = p;
+            for (; p != end && *p != '(' && *p != ')' && !is_space(*p); ++p)
+                if (*p == '\\')
+                    return false;
+            handler.on_atom(std::string(begin, p));
+        }
+    }
+    return true;
+}
+
+/// parser handler compiling input into the tree of nodes
+class Compiler
+{
+public:
+    Compiler(env_ptr const &env,
+             Interpreter::atom_converter_type const &convert_atom,
+             std::vector<Node> &dst)
+        : env_(env), convert_atom_(convert_atom), slot_(0)
+    {
+        stack_.push_back(&dst);
+    }
+
+    void on_list_begin()
+    {
+        auto &items = *stack_.back();
+        items.push_back(Node(Node::Form, 0));
+        stack_.push_back(&items.back().items);
+    }
+
+    void on_list_end()
+    {
+        if (stack_.back()->empty())
+            throw Error("Evaluation of empty expression");
+        stack_.pop_back();
+    }
+
+    void on_comment(std::string &&) { }
+    void on_eof() { }
+
+    void on_string(std::string &&)
+    {
+        stack_.back()->push_back(Node(Node::String, slot_++));
+    }
+
+    void on_atom(std::string &&s)
+    {
+        if (is_literal_atom(s))
+            stack_.back()->push_back(Node(Node::Literal, slot_++));
+        else
+            stack_.back()->push_back(eval(env_, convert_atom_(std::move(s))));
+    }
+
+private:
+    env_ptr const &env_;
+    Interpreter::atom_converter_type const &convert_atom_;
+    std::vector<std::vector<Node>*> stack_;
+    size_t slot_;
+};
+
+}
+
+class FormCacheImpl
+{
+public:
+    FormCacheImpl(env_ptr env, size_t capacity,
+                  Interpreter::atom_converter_type atom_converter)
+        : env_(env)
+        , capacity_(capacity)
+        , convert_atom_(atom_converter)
+        , hits_(0), misses_(0), evictions_(0)
+    {}
+
+    expr_list_type eval(std::string const &src);
+    FormCache::Stats stats() const
+    {
+        return FormCache::Stats{hits_, misses_, evictions_, index_.size()};
+    }
+
+    void clear()
+    {
+        index_.clear();
+        forms_.clear();
+    }
+
+    void set_profiler(std::shared_ptr<Profiler> p)
+    {
+        profiler_ = std::move(p);
+    }
+
+    void set_limits(Limits const &limits)
+    {
+        budget_ = cor::make_unique<Budget>(limits);
+    }
+
+private:
+    struct Entry
+    {
+        std::string key;
+        std::vector<Node> forms;
+    };
+    typedef std::list<Entry> forms_type;
+
+    std::vector<Node> const& compile(std::string const &src);
+    expr_ptr eval(Node const &);
+
+    env_ptr env_;
+    size_t capacity_;
+    Interpreter::atom_converter_type convert_atom_;
+    std::shared_ptr<Profiler> profiler_;
+    std::unique_ptr<Budget> budget_;
+    unsigned long hits_;
+    unsigned long misses_;
+    unsigned long evictions_;
+
+    // most recently used forms are at the front
+    forms_type forms_;
+    std::unordered_map<std::string, forms_type::iterator> index_;
+
+    std::string key_;
+    std::vector<std::string> literals_;
+    std::istringstream in_;
+};
+
+std::vector<Node> const& FormCacheImpl::compile(std::string const &src)
+{
+    ShapeBuilder shape(key_, literals_);
+    if (!parse_simple(src, shape)) {
+        ShapeBuilder full(key_, literals_);
+        in_.str(src);
+        in_.clear();
+        cor::sexp::parse(in_, full);
+    }
+
+    auto p = index_.find(key_);
+    if (p != index_.end()) {
+        ++hits_;
+        forms_.splice(forms_.begin(), forms_, p->second);
+        return p->second->forms;
+    }
+
+    ++misses_;
+    std::vector<Node> forms;
+    in_.str(src);
+    in_.clear();
+    Compiler compiler(env_, convert_atom_, forms);
+    cor::sexp::parse(in_, compiler);
+
+    if (capacity_ && index_.size() >= capacity_) {
+        index_.erase(forms_.back().key);
+        forms_.pop_back();
+        ++evictions_;
+    }
+    forms_.push_front(Entry{key_, std::move(forms)});
+    index_[key_] = forms_.begin();
+    return forms_.front().forms;
+}
+
+expr_ptr FormCacheImpl::eval(Node const &node)
+{
+    switch (node.kind) {
+    case Node::Value:
+        return node.value;
+    case Node::Literal:
+        return notlisp::eval(env_, convert_atom_
+                             (std::move(literals_[node.slot])));
+    case Node::String:
+        return mk_string(literals_[node.slot]);
+    case Node::Form:
+        break;
+    }
+
+    DepthScope scope(active_budget);
+    expr_list_type t;
+    for (auto const &item : node.items)
+        t.push_back(eval(item));
+
+    auto p = form_function(env_, t);
+    return call_function(env_, static_cast<FunctionExpr&>(*p)
+                         , notlisp::eval(env_, t), profiler_.get());
+}
+
+expr_list_type FormCacheImpl::eval(std::string const &src)
+{
+    if (budget_)
+        budget_->reset();
+    BudgetScope scope(budget_.get());
+    expr_list_type res;
+    for (auto const &node : compile(src))
+        res.push_back(eval(node));
+    return res;
+}
+
+FormCache::FormCache(env_ptr env, size_t capacity,
+                     Interpreter::atom_converter_type atom_converter)
+    : impl_(cor::make_unique<FormCacheImpl>(env, capacity, atom_converter))
+{
+}
+
+FormCache::FormCache(FormCache &&src)
+    : impl_(std::move(src.impl_))
+{
+}
+
+FormCache::~FormCache()
+{
+}
+
+expr_list_type FormCache::eval(std::string const &src)
+{
+    return impl_->eval(src);
+}
+
+void FormCache::set_limits(Limits const &limits)
+{
+    impl_->set_limits(limits);
+}
+
+void FormCache::set_profiler(std::shared_ptr<Profiler> p)
+{
+    impl_->set_profiler(std::move(p));
+}
+
+FormCache::Stats FormCache::stats() const
+{
+    return impl_->stats();
+}
+
+void FormCache::clear()
+{
+    impl_->clear();
 }
 
 expr_list_type eval(env_ptr env, expr_list_type const &src)
@@ -186,6 +942,11 @@ ListAccessor & operator >> (ListAccessor &src, expr_ptr dst)
 }
 
 expr_ptr ListAccessor::required()
+{
+    return next_required();
+}
+
+expr_ptr const& ListAccessor::next_required()
 {
     if (cur == end)
         throw Error("Required param is absent");
@@ -200,10 +961,10 @@ std::basic_ostream<char> & operator <<
 expr_ptr List::do_eval(env_ptr env, expr_ptr p)
 {
     expr_list_type res;
-    auto self = std::dynamic_pointer_cast<List>(p);
-    if (!self)
+    if (!p || p->expr_class() != Expr::ListClass)
         return mk_nil();
-    auto &src = self->items;
+    DepthScope scope(active_budget);
+    auto &src = static_cast<List&>(*p).items;
     for (auto &v : src)
         res.push_back(eval(env, v));
     return std::make_shared<List>(std::move(res));
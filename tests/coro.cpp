@@ -0,0 +1,288 @@
+#include <cor/coro.hpp>
+#include <cor/event_loop.hpp>
+#include <cor/io_engine.hpp>
+#include <cor/mt.hpp>
+#include <cor/util.hpp>
+#include <tut/tut.hpp>
+
+#include "tests_common.hpp"
+
+#include <future>
+#include <thread>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace tut
+{
+
+struct coro_test
+{
+    virtual ~coro_test()
+    {
+    }
+};
+
+typedef test_group<coro_test> tf;
+typedef tf::object object;
+tf cor_coro_test("coro");
+
+enum test_ids {
+    tid_schedule =  1,
+    tid_sleep,
+    tid_fd_ready,
+    tid_event_loop,
+    tid_not_resumed,
+    tid_io
+};
+
+namespace {
+
+/// fd is polled in a separate thread
+class PollReactor
+{
+public:
+    ~PollReactor()
+    {
+        for (auto &t : threads_)
+            t.join();
+    }
+
+    bool watch_once(int fd, short events, cor::Task task)
+    {
+        threads_.emplace_back([fd, events, task = std::move(task)]() mutable {
+                pollfd p = {fd, events, 0};
+                ::poll(&p, 1, -1);
+                task();
+            });
+        return true;
+    }
+
+private:
+    std::vector<std::thread> threads_;
+};
+
+template <typename ExecutorT>
+cor::coro::Detached get_thread_id
+(ExecutorT &executor, std::promise<std::thread::id> &dst)
+{
+    bool is_scheduled = co_await cor::coro::schedule(executor);
+    if (is_scheduled)
+        dst.set_value(std::this_thread::get_id());
+    else
+        dst.set_exception(std::make_exception_ptr(cor::Error("Stopped")));
+}
+
+cor::coro::Detached sleep
+(cor::TaskQueue &q, std::chrono::milliseconds timeout
+ , std::promise<std::chrono::steady_clock::duration> &dst)
+{
+    auto begin = std::chrono::steady_clock::now();
+    bool is_queued = co_await cor::coro::sleep_for(q, timeout);
+    if (is_queued)
+        dst.set_value(std::chrono::steady_clock::now() - begin);
+    else
+        dst.set_exception(std::make_exception_ptr(cor::Error("Stopped")));
+}
+
+/// coroutine owned by the caller, frame is destroyed with the object
+struct Owned
+{
+    struct promise_type
+    {
+        Owned get_return_object()
+        {
+            return Owned(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Owned(std::coroutine_handle<promise_type> h) : handle(h) {}
+    Owned(Owned &&from) : handle(from.handle) { from.handle = nullptr; }
+    ~Owned()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+Owned owned_sleep
+(cor::TaskQueue &q, std::chrono::milliseconds timeout, bool &is_resumed)
+{
+    co_await cor::coro::sleep_for(q, timeout);
+    is_resumed = true;
+}
+
+/// sends request and receives reply of the same size, data is passed
+/// by value to be kept by the coroutine frame
+cor::coro::Detached request
+(cor::IoEngine &engine, int fd, std::string data
+ , std::promise<std::string> &dst)
+{
+    ssize_t rc = co_await cor::coro::write(engine, fd, data.data(), data.size());
+    if (rc != (ssize_t)data.size()) {
+        dst.set_exception(std::make_exception_ptr(cor::Error("Write failed")));
+        co_return;
+    }
+    std::string reply(data.size(), ' ');
+    rc = co_await cor::coro::read(engine, fd, &reply[0], reply.size());
+    if (rc != (ssize_t)reply.size())
+        dst.set_exception(std::make_exception_ptr(cor::Error("Read failed")));
+    else
+        dst.set_value(reply);
+}
+
+template <typename ReactorT>
+cor::coro::Detached read_pipe
+(ReactorT &reactor, int fd, std::promise<char> &dst)
+{
+    co_await cor::coro::readable(reactor, fd);
+    char c = 0;
+    if (::read(fd, &c, 1) != 1)
+        dst.set_exception(std::make_exception_ptr(cor::Error("No data")));
+    else
+        dst.set_value(c);
+}
+
+}
+
+template<> template<>
+void object::test<tid_schedule>()
+{
+    {
+        cor::TaskQueue q;
+        std::promise<std::thread::id> res;
+        auto f = res.get_future();
+        get_thread_id(q, res);
+        ensure_ne("Resumed in the queue thread", f.get()
+                  , std::this_thread::get_id());
+    }
+    {
+        cor::ThreadPool pool(2);
+        std::promise<std::thread::id> res;
+        auto f = res.get_future();
+        get_thread_id(pool, res);
+        ensure_ne("Resumed in the pool thread", f.get()
+                  , std::this_thread::get_id());
+    }
+    {
+        cor::TaskQueue q;
+        q.stop();
+        std::promise<std::thread::id> res;
+        auto f = res.get_future();
+        get_thread_id(q, res);
+        try {
+            f.get();
+            fail("Stopped queue should not accept coroutine");
+        } catch (cor::Error const &) {
+        }
+    }
+}
+
+template<> template<>
+void object::test<tid_sleep>()
+{
+    using namespace std::chrono;
+    cor::TaskQueue q;
+    std::promise<steady_clock::duration> res;
+    auto f = res.get_future();
+    sleep(q, milliseconds(20), res);
+    ensure("Slept enough", f.get() >= milliseconds(20));
+
+    cor::TaskQueue stopped;
+    stopped.stop();
+    std::promise<steady_clock::duration> stopped_res;
+    auto stopped_f = stopped_res.get_future();
+    sleep(stopped, milliseconds(20), stopped_res);
+    ensure_throws<cor::Error>("Stopped queue does not accept timer"
+                              , [&stopped_f]() { stopped_f.get(); });
+}
+
+template<> template<>
+void object::test<tid_fd_ready>()
+{
+    int fds[2];
+    ensure_eq("Pipe is created", ::pipe(fds), 0);
+    cor::FdHandle rd(fds[0]), wr(fds[1]);
+    std::promise<char> res;
+    auto f = res.get_future();
+    {
+        PollReactor reactor;
+        read_pipe(reactor, rd.value(), res);
+        ensure_eq("Not resumed yet", f.wait_for(std::chrono::milliseconds(10))
+                  , std::future_status::timeout);
+        ensure_eq("Written", ::write(wr.value(), "x", 1), 1);
+        ensure_eq("Read after resume", f.get(), 'x');
+    }
+}
+
+template<> template<>
+void object::test<tid_event_loop>()
+{
+    cor::Pipe pipe;
+    cor::EventLoop loop;
+    std::thread t([&loop]() { loop.run(); });
+    std::promise<char> res;
+    auto f = res.get_future();
+    read_pipe(loop, pipe.first(), res);
+    ensure_eq("Not resumed yet", f.wait_for(std::chrono::milliseconds(10))
+              , std::future_status::timeout);
+    ensure_eq("Written", ::write(pipe.second(), "x", 1), 1);
+    ensure_eq("Resumed by the loop", f.get(), 'x');
+    loop.stop();
+    t.join();
+
+    std::promise<char> stopped_res;
+    auto stopped_f = stopped_res.get_future();
+    ensure_eq("Written again", ::write(pipe.second(), "y", 1), 1);
+    read_pipe(loop, pipe.first(), stopped_res);
+    ensure_eq("Stopped loop does not watch, coroutine continues"
+              , stopped_f.get(), 'y');
+}
+
+template<> template<>
+void object::test<tid_not_resumed>()
+{
+    using namespace std::chrono;
+    bool is_resumed = false;
+    std::unique_ptr<Owned> co;
+    {
+        cor::TaskQueue q;
+        co.reset(new Owned(owned_sleep(q, hours(1), is_resumed)));
+    }
+    ensure("Not resumed after queue is destroyed", !is_resumed);
+    ensure("Suspended", !co->handle.done());
+    // frame is destroyed by the owner
+    co.reset();
+}
+
+template<> template<>
+void object::test<tid_io>()
+{
+    for (auto backend : {cor::IoEngine::Auto, cor::IoEngine::Epoll}) {
+        cor::IoEngine engine(8, backend);
+        int sv[2];
+        ensure_eq("Socket pair", ::socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        cor::FdHandle a(sv[0]), b(sv[1]);
+
+        std::promise<std::string> res;
+        auto f = res.get_future();
+        // coroutine is resumed by run_once() in this thread
+        request(engine, a.value(), "ping", res);
+        for (int i = 0; engine.pending() && i < 1000; ++i) {
+            engine.run_once(10);
+            char buf[4];
+            if (::recv(b.value(), buf, sizeof(buf), MSG_DONTWAIT) == 4)
+                ensure_eq("Reply is sent", ::write(b.value(), "pong", 4), 4);
+        }
+        ensure_eq("Resumed with reply", f.get(), "pong");
+    }
+}
+
+}
@@ -0,0 +1,204 @@
+#include <cor/event_loop.hpp>
+#include <cor/inotify.hpp>
+#include <cor/os.hpp>
+#include <cor/pipe.hpp>
+#include <tut/tut.hpp>
+
+#include "tests_common.hpp"
+
+#include <atomic>
+#include <future>
+#include <thread>
+#include <fstream>
+#include <cstdlib>
+#include <unistd.h>
+
+namespace tut
+{
+
+struct event_loop_test
+{
+    virtual ~event_loop_test()
+    {
+    }
+};
+
+typedef test_group<event_loop_test> tf;
+typedef tf::object object;
+tf cor_event_loop_test("event_loop");
+
+enum test_ids {
+    tid_sources =  1,
+    tid_edge_triggered,
+    tid_enqueue,
+    tid_task_queue,
+    tid_watch_once
+};
+
+namespace {
+
+void write_byte(int fd)
+{
+    char c = 'x';
+    if (::write(fd, &c, 1) != 1)
+        throw cor::Error("Can't write to fd %d", fd);
+}
+
+void read_byte(int fd)
+{
+    char c;
+    if (::read(fd, &c, 1) != 1)
+        throw cor::Error("Can't read from fd %d", fd);
+}
+
+}
+
+template<> template<>
+void object::test<tid_sources>()
+{
+    cor::EventLoop loop;
+    auto posix_pipe = cor::posix::Pipe::create();
+    auto const &rd = cor::get<cor::posix::Pipe::Read>(posix_pipe);
+    cor::Pipe pipe;
+    cor::inotify::Handle inotify;
+    char dir_template[] = "/tmp/cor-event-loop-XXXXXX";
+    std::string dir(::mkdtemp(dir_template));
+    cor::inotify::Watch watch(inotify, dir, IN_CREATE);
+
+    // handler exceptions are not propagated, so events are checked
+    // after the loop is stopped
+    std::atomic<int> ready(0);
+    std::atomic<uint32_t> rd_events(0);
+    loop.add(rd, EPOLLIN, [&](uint32_t events) {
+            rd_events |= events;
+            read_byte(rd.value());
+            ready |= 1;
+        });
+    loop.add(pipe, EPOLLIN, [&](uint32_t) {
+            read_byte(pipe.first());
+            ready |= 2;
+        });
+    loop.add(inotify, EPOLLIN, [&](uint32_t) {
+            char buf[1024];
+            inotify.read(buf, sizeof(buf));
+            ready |= 4;
+        });
+
+    std::thread t([&loop]() { loop.run(); });
+    write_byte(cor::get<cor::posix::Pipe::Write>(posix_pipe).value());
+    write_byte(pipe.second());
+    auto path = dir + "/file";
+    std::ofstream(path.c_str()) << "x";
+
+    for (int i = 0; ready != 7 && i < 5000; ++i)
+        ::usleep(1000);
+    loop.stop();
+    t.join();
+    ::unlink(path.c_str());
+    ::rmdir(dir.c_str());
+    ensure_eq("All sources are dispatched", (int)ready, 7);
+    ensure("Readable", rd_events & EPOLLIN);
+}
+
+template<> template<>
+void object::test<tid_edge_triggered>()
+{
+    cor::EventLoop loop;
+    cor::Pipe level, edge;
+    int level_count = 0, edge_count = 0;
+    loop.add(level, EPOLLIN, [&level_count](uint32_t) { ++level_count; });
+    loop.add(edge, EPOLLIN, [&edge_count](uint32_t) { ++edge_count; }
+             , cor::EventLoop::Edge);
+    write_byte(level.second());
+    write_byte(edge.second());
+    loop.run_once(0);
+    loop.run_once(0);
+    ensure_eq("Level-triggered is reported until read", level_count, 2);
+    ensure_eq("Edge-triggered is reported once", edge_count, 1);
+
+    loop.remove(level);
+    loop.run_once(0);
+    ensure_eq("Removed source is not dispatched", level_count, 2);
+
+    try {
+        loop.add(edge, EPOLLIN, [](uint32_t) {});
+        fail("Source can't be added twice");
+    } catch (cor::Error const &) {
+    }
+}
+
+template<> template<>
+void object::test<tid_enqueue>()
+{
+    cor::EventLoop loop;
+    std::promise<std::thread::id> res;
+    auto f = res.get_future();
+    std::thread t([&loop]() { loop.run(); });
+    ensure("Enqueued failing", loop.enqueue([]() {
+                throw cor::Error("Task error");
+            }));
+    ensure("Enqueued", loop.enqueue([&res]() {
+                res.set_value(std::this_thread::get_id());
+            }));
+    ensure("Executed in the loop thread", f.get() == t.get_id());
+    loop.stop();
+    t.join();
+    ensure("Stopped loop does not accept tasks", !loop.enqueue([]() {}));
+}
+
+template<> template<>
+void object::test<tid_task_queue>()
+{
+    cor::EventLoop loop;
+    cor::TaskQueue q;
+    cor::Pipe pipe;
+    std::atomic<int> count(0);
+    std::promise<std::thread::id> res;
+    q.enqueue([&res]() { res.set_value(std::this_thread::get_id()); });
+    auto queue_thread = res.get_future().get();
+
+    bool is_queue_thread = true;
+    loop.add(pipe, EPOLLIN, q, [&](uint32_t) {
+            is_queue_thread = is_queue_thread
+                && std::this_thread::get_id() == queue_thread;
+            read_byte(pipe.first());
+            ++count;
+        });
+    std::thread t([&loop]() { loop.run(); });
+    for (int expected = 1; expected <= 3; ++expected) {
+        write_byte(pipe.second());
+        for (int i = 0; count != expected && i < 5000; ++i)
+            ::usleep(1000);
+        ensure_eq("Handler is called again after rearm", (int)count
+                  , expected);
+    }
+    loop.stop();
+    t.join();
+    q.stop();
+    q.join();
+    ensure("Handler is called from the queue thread", is_queue_thread);
+}
+
+template<> template<>
+void object::test<tid_watch_once>()
+{
+    cor::EventLoop loop;
+    cor::Pipe pipe;
+    int count = 0;
+    ensure("Watched", loop.watch_once(pipe.first(), POLLIN, [&count]() {
+                ++count;
+            }));
+    ensure("Already watched", !loop.watch_once(pipe.first(), POLLIN, []() {}));
+    loop.run_once(0);
+    ensure_eq("Not ready", count, 0);
+    write_byte(pipe.second());
+    loop.run_once(0);
+    loop.run_once(0);
+    ensure_eq("Called once", count, 1);
+    ensure("Can be watched again", loop.watch_once(pipe.first(), POLLIN
+                                                   , [&count]() { ++count; }));
+    loop.run_once(0);
+    ensure_eq("Called again", count, 2);
+}
+
+}
@@ -0,0 +1,176 @@
+#include <cor/io_engine.hpp>
+#include <cor/event_loop.hpp>
+#include <cor/pipe.hpp>
+#include <tut/tut.hpp>
+
+#include "tests_common.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace tut
+{
+
+struct io_engine_test
+{
+    virtual ~io_engine_test()
+    {
+    }
+};
+
+typedef test_group<io_engine_test> tf;
+typedef tf::object object;
+tf cor_io_engine_test("io_engine");
+
+enum test_ids {
+    tid_pipe =  1,
+    tid_fixed_buffers,
+    tid_event_loop,
+    tid_full_duplex
+};
+
+namespace {
+
+/// io_uring can be disabled, Auto falls back to epoll then
+std::vector<cor::IoEngine::Backend> backends()
+{
+    return {cor::IoEngine::Auto, cor::IoEngine::Epoll};
+}
+
+void run_all(cor::IoEngine &engine)
+{
+    for (int i = 0; engine.pending() && i < 1000; ++i)
+        engine.run_once(10);
+    ensure_eq("All operations are completed", engine.pending(), 0u);
+}
+
+}
+
+template<> template<>
+void object::test<tid_pipe>()
+{
+    for (auto backend : backends()) {
+        cor::IoEngine engine(8, backend);
+        ensure("Backend is chosen", engine.backend() != cor::IoEngine::Auto);
+        cor::Pipe pipe;
+
+        // more operations than ring entries
+        static const size_t count = 20;
+        std::string const src("0123456789abcdefghij");
+        std::vector<ssize_t> results;
+        for (size_t i = 0; i < count; ++i)
+            engine.write(pipe.second(), &src[i], 1, [&results](ssize_t rc) {
+                    results.push_back(rc);
+                });
+        run_all(engine);
+        ensure_eq("All writes are completed", results.size(), count);
+        for (auto rc : results)
+            ensure_eq("Byte is written", rc, 1);
+
+        std::string dst(count, ' ');
+        ssize_t read_rc = 0;
+        engine.read(pipe.first(), &dst[0], dst.size(), [&read_rc](ssize_t rc) {
+                read_rc = rc;
+            });
+        run_all(engine);
+        ensure_eq("Data is read", read_rc, (ssize_t)count);
+        ensure_eq("Data is the same", dst, src);
+
+        ssize_t bad_rc = 0;
+        engine.read(-1, &dst[0], 1, [&bad_rc](ssize_t rc) { bad_rc = rc; });
+        run_all(engine);
+        ensure_eq("Error is reported", bad_rc, -EBADF);
+    }
+}
+
+template<> template<>
+void object::test<tid_fixed_buffers>()
+{
+    for (auto backend : backends()) {
+        cor::IoEngine engine(8, backend);
+        char path_template[] = "/tmp/cor-io-engine-XXXXXX";
+        cor::FdHandle file(::mkstemp(path_template));
+        ensure("File is created", file.is_valid());
+        ::unlink(path_template);
+
+        std::vector<char> buf(4096);
+        engine.register_buffers({{buf.data(), buf.size()}});
+        std::string const data("fixed");
+        std::copy(data.begin(), data.end(), buf.begin());
+        ssize_t write_rc = 0, read_rc = 0;
+        engine.write_fixed(file.value(), 0, buf.data(), data.size()
+                           , [&write_rc](ssize_t rc) { write_rc = rc; }, 100);
+        run_all(engine);
+        ensure_eq("Written", write_rc, (ssize_t)data.size());
+
+        engine.read_fixed(file.value(), 0, &buf[1024], data.size()
+                          , [&read_rc](ssize_t rc) { read_rc = rc; }, 100);
+        run_all(engine);
+        ensure_eq("Read", read_rc, (ssize_t)data.size());
+        ensure_eq("Read from offset", std::string(&buf[1024], data.size())
+                  , data);
+    }
+}
+
+template<> template<>
+void object::test<tid_event_loop>()
+{
+    for (auto backend : backends()) {
+        cor::EventLoop loop;
+        cor::IoEngine engine(8, backend);
+        cor::Pipe pipe;
+        loop.add(engine, EPOLLIN, [&engine](uint32_t) {
+                engine.run_once(0);
+            });
+
+        char c = 0;
+        ssize_t read_rc = 0;
+        engine.read(pipe.first(), &c, 1, [&read_rc](ssize_t rc) {
+                read_rc = rc;
+            });
+        engine.submit();
+        ensure_eq("Written", ::write(pipe.second(), "x", 1), 1);
+        for (int i = 0; engine.pending() && i < 1000; ++i)
+            loop.run_once(10);
+        ensure_eq("Completed by the loop", read_rc, 1);
+        ensure_eq("Read", c, 'x');
+    }
+}
+
+template<> template<>
+void object::test<tid_full_duplex>()
+{
+    for (auto backend : backends()) {
+        cor::IoEngine engine(8, backend);
+        int sv[2];
+        ensure_eq("Socket pair", ::socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        cor::FdHandle a(sv[0]), b(sv[1]);
+
+        // pending read should not block write to the same fd
+        char c = 0;
+        ssize_t read_rc = 0, write_rc = 0;
+        engine.read(a.value(), &c, 1, [&read_rc](ssize_t rc) {
+                read_rc = rc;
+            });
+        engine.write(a.value(), "data", 4, [&write_rc](ssize_t rc) {
+                write_rc = rc;
+            });
+        for (int i = 0; !write_rc && i < 100; ++i)
+            engine.run_once(10);
+        ensure_eq("Write is completed", write_rc, 4);
+        ensure_eq("Read is pending", engine.pending(), 1u);
+
+        char buf[4];
+        ensure_eq("Data is received", ::read(b.value(), buf, sizeof(buf)), 4);
+        ensure_eq("Reply is sent", ::write(b.value(), "r", 1), 1);
+        run_all(engine);
+        ensure_eq("Read is completed", read_rc, 1);
+        ensure_eq("Reply is read", c, 'r');
+    }
+}
+
+}
@@ -1,11 +1,22 @@
 #include <cor/mt.hpp>
+#include <cor/async.hpp>
 #include <cor/util.hpp>
 #include <tut/tut.hpp>
 
 #include "tests_common.hpp"
 
 #include <iostream>
+#include <atomic>
+#include <set>
+#include <vector>
+#include <array>
+#include <numeric>
+#include <algorithm>
+#include <fstream>
+#include <system_error>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 namespace tut
 {
@@ -26,6 +37,18 @@ enum test_ids {
     tid_basic_future_wake_before
     , tid_completion
     , tid_task_queue
+    , tid_thread_pool
+    , tid_task_queue_producers
+    , tid_task
+    , tid_task_queue_bulk
+    , tid_task_queue_timers
+    , tid_task_queue_priority
+    , tid_rw_mutex
+    , tid_completion_wake_all
+    , tid_async
+    , tid_affinity
+    , tid_task_queue_stats
+    , tid_thread_pool_start_error
 };
 
 template <typename Pred>
@@ -160,4 +183,607 @@ void object::test<tid_task_queue>()
     ensure("Should not be enqueued when stopped", !is_queued);
 }
 
+template<> template<>
+void object::test<tid_thread_pool>()
+{
+    cor::ThreadPool pool(4);
+    ensure_eq("Workers count", pool.size(), 4u);
+    std::atomic<int> count(0);
+    std::mutex m;
+    std::set<std::thread::id> threads;
+    for (int i = 0; i < 100; ++i) {
+        auto is_queued = pool.enqueue([&]() {
+                {
+                    std::lock_guard<std::mutex> l(m);
+                    threads.insert(std::this_thread::get_id());
+                }
+                // enqueued into the own worker queue
+                pool.enqueue([&count]() { ++count; });
+                ++count;
+            });
+        ensure("Should be enqueued", is_queued);
+    }
+    ensure("All tasks should be executed"
+           , wait_while([&count]() { return count != 200; }, 5000));
+    ensure("Pool is empty", wait_while([&pool]() { return !pool.empty(); }, 1000));
+    ensure("Tasks are executed by pool workers", threads.size() <= 4);
+    ensure("Not in the caller thread"
+           , !threads.count(std::this_thread::get_id()));
+
+    // worker queue overflows
+    count = 0;
+    pool.enqueue([&]() {
+            for (int i = 0; i < 1000; ++i)
+                pool.enqueue([&count]() { ++count; });
+        });
+    ensure("Overflow tasks should be executed"
+           , wait_while([&count]() { return count != 1000; }, 5000));
+    pool.stop();
+    pool.join();
+    auto is_queued = pool.enqueue([]() {});
+    ensure("Should not be enqueued when stopped", !is_queued);
+}
+
+template<> template<>
+void object::test<tid_task_queue_producers>()
+{
+    cor::TaskQueue q;
+    enum { producers_count = 4, tasks_count = 10000 };
+    // accessed only from the queue thread
+    std::vector<int> last(producers_count, -1);
+    bool is_ordered = true;
+    std::atomic<int> count(0);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producers_count; ++p) {
+        producers.emplace_back([&, p]() {
+                for (int i = 0; i < tasks_count; ++i) {
+                    q.enqueue([&, p, i]() {
+                            if (last[p] + 1 != i)
+                                is_ordered = false;
+                            last[p] = i;
+                            ++count;
+                        });
+                }
+            });
+    }
+    for (auto &t : producers)
+        t.join();
+
+    ensure("All tasks should be executed", wait_while([&count]() {
+                return count != producers_count * tasks_count;
+            }, 5000));
+    q.stop();
+    q.join();
+    ensure("Tasks of each producer are executed in order", is_ordered);
+}
+
+template<> template<>
+void object::test<tid_task>()
+{
+    int count = 0;
+    cor::Task empty_task;
+    ensure("Empty task", !empty_task);
+
+    cor::Task small([&count]() { ++count; });
+    ensure("Small task", (bool)small);
+    cor::Task moved(std::move(small));
+    ensure("Moved from", !small);
+    moved();
+    ensure_eq("Small task is executed", count, 1);
+
+    std::array<long, 32> big_data;
+    big_data.fill(1);
+    cor::Task big([&count, big_data]() { count += big_data[31]; });
+    moved = std::move(big);
+    moved();
+    ensure_eq("Big task is executed", count, 2);
+
+    struct MoveOnly
+    {
+        void operator ()() { ++*count; }
+        std::unique_ptr<int> count;
+        std::shared_ptr<int> data;
+    };
+    auto data = std::make_shared<int>(5);
+    {
+        cor::Task move_only(MoveOnly{cor::make_unique<int>(0), data});
+        move_only();
+    }
+    ensure_eq("Captured data is released", data.use_count(), 1);
+
+    cor::TaskQueue q;
+    std::atomic<int> executed(0);
+    for (int i = 0; i < 100; ++i)
+        q.enqueue([&executed]() { ++executed; });
+    std::packaged_task<void()> with_future([]() {
+            throw cor::Error("Task error");
+        });
+    auto future = with_future.get_future();
+    q.enqueue(std::move(with_future));
+    // exception is not propagated from fire-and-forget task
+    q.enqueue([]() { throw cor::Error("Task error"); });
+    q.enqueue([]() { throw 1; });
+    q.enqueue([&executed]() { ++executed; });
+    ensure("All tasks are executed"
+           , wait_while([&q]() { return !q.empty(); }, 5000));
+    ensure_eq("Executed count", executed.load(), 101);
+    try {
+        future.get();
+        fail("Exception is expected");
+    } catch (cor::Error const &) {
+    }
+}
+
+template<> template<>
+void object::test<tid_task_queue_bulk>()
+{
+    cor::TaskQueue q;
+    std::vector<int> data;
+    std::vector<std::function<void()> > tasks;
+    for (int i = 0; i < 100; ++i)
+        tasks.push_back([&data, i]() { data.push_back(i); });
+    ensure("Should be enqueued", q.enqueue_bulk(tasks));
+
+    cor::TaskBatch batch;
+    for (int i = 100; i < 200; ++i)
+        batch.push([&data, i]() { data.push_back(i); });
+    ensure_eq("Batch size", batch.size(), 100u);
+    ensure("Batch should be enqueued", q.enqueue_bulk(std::move(batch)));
+    ensure("Batch is moved", batch.empty());
+
+    ensure("All tasks are executed"
+           , wait_while([&q]() { return !q.empty(); }, 5000));
+    std::vector<int> expected(200);
+    std::iota(expected.begin(), expected.end(), 0);
+    ensure("Tasks are executed in order", data == expected);
+
+    // more nodes are freed than kept by the pool
+    data.clear();
+    for (int round = 0; round < 3; ++round) {
+        cor::TaskBatch many;
+        for (int i = 0; i < 10000; ++i)
+            many.push([&data, i]() { data.push_back(i); });
+        ensure("Many should be enqueued", q.enqueue_bulk(std::move(many)));
+    }
+    ensure("Many are executed"
+           , wait_while([&q]() { return !q.empty(); }, 5000));
+    ensure_eq("Many count", data.size(), 30000u);
+
+    q.stop();
+    cor::TaskBatch rejected;
+    rejected.push([&data]() { data.push_back(-1); });
+    ensure("Should not be enqueued when stopped"
+           , !q.enqueue_bulk(std::move(rejected)));
+}
+
+template<> template<>
+void object::test<tid_task_queue_timers>()
+{
+    using namespace std::chrono;
+    typedef cor::TaskQueue::clock_type clock_type;
+    cor::TaskQueue q;
+    std::mutex m;
+    std::vector<int> order;
+    auto start = clock_type::now();
+    bool is_early = false;
+    for (int i : {30, 10, 20}) {
+        q.enqueue_after(milliseconds(i), [&, i]() {
+                std::lock_guard<std::mutex> l(m);
+                if (clock_type::now() - start < milliseconds(i))
+                    is_early = true;
+                order.push_back(i);
+            });
+    }
+    bool is_cancelled_fired = false;
+    auto cancelled = q.enqueue_after(milliseconds(15), [&]() {
+            is_cancelled_fired = true;
+        });
+    ensure("Timer is active", cancelled.is_active());
+    ensure("Timer is cancelled", cancelled.cancel());
+    ensure("Timer is cancelled once", !cancelled.cancel());
+    ensure("Timer is not active", !cancelled.is_active());
+
+    std::atomic<int> ticks(0);
+    auto periodic = q.enqueue_periodic(milliseconds(2), [&ticks]() {
+            ++ticks;
+        });
+
+    // a lot of timers expiring at different wheel levels
+    enum { timers_count = 20000 };
+    std::atomic<int> expired(0);
+    std::vector<cor::Timer> timers;
+    for (int i = 0; i < timers_count; ++i)
+        timers.push_back(q.enqueue_at(start + milliseconds(i % 200)
+                                      , [&expired]() { ++expired; }));
+    int cancelled_count = 0;
+    for (int i = 0; i < timers_count; i += 2)
+        if (timers[i].cancel())
+            ++cancelled_count;
+    ensure("Pending timers are cancelled", cancelled_count > 0);
+    auto far = q.enqueue_after(hours(10), []() {});
+
+    ensure("Timers should fire", wait_while([&]() {
+                std::lock_guard<std::mutex> l(m);
+                return order.size() != 3
+                    || expired != timers_count - cancelled_count
+                    || ticks < 5;
+            }, 5000));
+    ensure("Periodic timer is cancelled", periodic.cancel());
+    auto ticks_count = ticks.load();
+    ::usleep(20000);
+    ensure("Periodic timer should not fire after cancel"
+           , ticks <= ticks_count + 1);
+
+    ensure("Not fired before time", !is_early);
+    std::vector<int> expected{10, 20, 30};
+    ensure("Fired in order", order == expected);
+    ensure("Cancelled timer is not fired", !is_cancelled_fired);
+    ensure_eq("Only not cancelled timers fired", expired.load()
+              , timers_count - cancelled_count);
+    ensure("One-shot timer is inactive after firing", !timers[1].is_active());
+    ensure("Far timer is active", far.is_active());
+    q.stop();
+    q.join();
+    ensure("No timers on the stopped queue"
+           , !q.enqueue_after(milliseconds(1), []() {}).is_active());
+}
+
+template<> template<>
+void object::test<tid_task_queue_priority>()
+{
+    cor::TaskQueue q;
+    std::atomic<bool> is_blocked(true);
+    q.enqueue([&is_blocked]() {
+            while (is_blocked)
+                ::usleep(100);
+        });
+    // accessed only from the queue thread
+    std::vector<cor::TaskQueue::Priority> order;
+    auto add = [&](cor::TaskQueue::Priority p, int count) {
+        for (int i = 0; i < count; ++i)
+            q.enqueue([&order, p]() { order.push_back(p); }, p);
+    };
+    add(cor::TaskQueue::Low, 100);
+    add(cor::TaskQueue::Normal, 100);
+    add(cor::TaskQueue::High, 10);
+    ensure_eq("Low depth", q.depth(cor::TaskQueue::Low), 100u);
+    ensure_eq("Normal depth", q.depth(cor::TaskQueue::Normal), 101u);
+    ensure_eq("High depth", q.depth(cor::TaskQueue::High), 10u);
+    is_blocked = false;
+    ensure("All tasks are executed"
+           , wait_while([&q]() { return !q.empty(); }, 5000));
+    ensure_eq("All tasks are executed", order.size(), 210u);
+    ensure_eq("Lane is empty", q.depth(cor::TaskQueue::Low), 0u);
+
+    auto pos = [&order](cor::TaskQueue::Priority p, bool is_last) {
+        auto it = is_last
+        ? std::find(order.rbegin(), order.rend(), p).base() - 1
+        : std::find(order.begin(), order.end(), p);
+        return it - order.begin();
+    };
+    ensure("High priority tasks are executed first"
+           , pos(cor::TaskQueue::High, true) < 20);
+    ensure("Low priority lane is not starving"
+           , pos(cor::TaskQueue::Low, false) < 20);
+    ensure("Normal tasks are executed before low ones"
+           , pos(cor::TaskQueue::Normal, true) < pos(cor::TaskQueue::Low, true));
+}
+
+template <typename MutexT>
+void check_rw_mutex(MutexT const &m)
+{
+    {
+        auto l1 = cor::rlock(m);
+        bool is_shared = false;
+        std::thread t([&]() {
+                auto l2 = cor::rlock(m);
+                is_shared = true;
+            });
+        t.join();
+        ensure("Readers are not blocking each other", is_shared);
+    }
+
+    long a = 0, b = 0;
+    std::atomic<bool> is_consistent(true);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+                for (int i = 0; i < 10000; ++i) {
+                    if (i % 10 == t) {
+                        auto l = cor::wlock(m);
+                        ++a;
+                        ++b;
+                    } else {
+                        auto l = cor::rlock(m);
+                        if (a != b)
+                            is_consistent = false;
+                    }
+                }
+            });
+    }
+    for (auto &t : threads)
+        t.join();
+    ensure("Writers are exclusive", is_consistent);
+    ensure_eq("All writes are done", a, 4000);
+}
+
+template<> template<>
+void object::test<tid_rw_mutex>()
+{
+    check_rw_mutex(cor::RWMutex());
+    check_rw_mutex(cor::RWMutex(cor::RWMutex::PreferWriters));
+    check_rw_mutex(cor::ScalableRWMutex());
+
+    cor::RWMutex m;
+    cor::RWMutex::WLock w(m);
+    ensure_throws<cor::CError>("Error is reported", [&m]() {
+            cor::RWMutex::RLock r(m);
+        });
+}
+
+template<> template<>
+void object::test<tid_completion_wake_all>()
+{
+    cor::Completion c;
+    c.up();
+    std::atomic<int> released(0);
+    std::vector<std::thread> waiters;
+    for (int i = 0; i < 4; ++i) {
+        waiters.emplace_back([&c, &released]() {
+                if (c.wait_for(std::chrono::seconds(5))
+                    == std::cv_status::no_timeout)
+                    ++released;
+            });
+    }
+    ::usleep(10000);
+    ensure_eq("Waiters are not released yet", released.load(), 0);
+    c.down();
+    for (auto &t : waiters)
+        t.join();
+    ensure_eq("All waiters are released", released.load(), 4);
+
+    c.up();
+    ensure_eq("Timeout", c.wait_for(std::chrono::milliseconds(10))
+              , std::cv_status::timeout);
+    c.down();
+    c.wait();
+
+    cor::BasicCondition cond;
+    ensure_eq("Condition timeout", cond.wait(std::chrono::milliseconds(10))
+              , std::cv_status::timeout);
+    std::thread t([&cond]() { cond.done(); });
+    ensure_eq("Condition is done", cond.wait(std::chrono::seconds(5))
+              , std::cv_status::no_timeout);
+    t.join();
+    ensure_eq("Condition is done before wait"
+              , cond.wait(std::chrono::milliseconds(1))
+              , std::cv_status::no_timeout);
+}
+
+template<> template<>
+void object::test<tid_async>()
+{
+    using cor::async::Promise;
+    using cor::async::Future;
+    cor::TaskQueue q;
+    cor::ThreadPool pool(2);
+
+    Promise<int> p;
+    auto f = p.get_future();
+    ensure("Not ready", !f.is_ready());
+    std::thread t([&p]() { p.set_value(21); });
+    auto res = f.then(q, [](int v) { return v * 2; })
+        .then(pool, [](int v) { return std::to_string(v); });
+    ensure("Future is consumed", !f.valid());
+    ensure_eq("Continuations are executed", res.get(), std::string("42"));
+    t.join();
+
+    bool is_called = false;
+    Promise<void> failed;
+    auto failed_res = failed.get_future().then(q, [&is_called]() {
+            is_called = true;
+        });
+    failed.set_exception(std::make_exception_ptr(cor::Error("Failed")));
+    try {
+        failed_res.get();
+        fail("Exception is expected");
+    } catch (cor::Error const &) {
+    }
+    ensure("Continuation is not called on error", !is_called);
+
+    auto thrown = cor::async::make_ready_future(1).then(q, [](int) -> int {
+            throw cor::Error("Thrown");
+        });
+    ensure_eq("Wait for exception", thrown.wait_for(std::chrono::seconds(5))
+              , std::future_status::ready);
+    try {
+        thrown.get();
+        fail("Exception is expected");
+    } catch (cor::Error const &) {
+    }
+
+    Future<int> broken;
+    {
+        Promise<int> p;
+        broken = p.get_future();
+    }
+    try {
+        broken.get();
+        fail("Broken promise is expected");
+    } catch (std::future_error const &e) {
+        ensure("Broken promise", e.code() == std::future_errc::broken_promise);
+    }
+
+    std::vector<Promise<int> > promises(3);
+    std::vector<Future<int> > futures;
+    for (auto &p : promises)
+        futures.push_back(p.get_future());
+    auto all = cor::async::when_all(std::move(futures));
+    promises[2].set_value(2);
+    promises[0].set_value(0);
+    ensure("Not all are ready", !all.is_ready());
+    promises[1].set_value(1);
+    std::vector<int> expected{0, 1, 2};
+    ensure("All values", all.get() == expected);
+
+    std::vector<Promise<std::string> > any_promises(3);
+    std::vector<Future<std::string> > any_futures;
+    for (auto &p : any_promises)
+        any_futures.push_back(p.get_future());
+    auto any = cor::async::when_any(std::move(any_futures));
+    pool.enqueue([&any_promises]() { any_promises[1].set_value("one"); });
+    auto first = any.get();
+    ensure_eq("First ready position", first.first, 1u);
+    ensure_eq("First ready value", first.second, std::string("one"));
+
+    std::vector<Future<void> > voids;
+    voids.push_back(cor::async::make_ready_future());
+    ensure("Void futures", (cor::async::when_all(std::move(voids)).get(), true));
+}
+
+template<> template<>
+void object::test<tid_affinity>()
+{
+    auto allowed = cor::CpuSet::allowed();
+    ensure("Some CPUs are allowed", !allowed.empty());
+    ensure("There is NUMA node", cor::numa::nodes_count() >= 1);
+    ensure("Node has CPUs", !cor::numa::node_cpus(0).empty());
+    auto cpu = allowed.cpus().front();
+
+    auto get_affinity = [](std::promise<cor::CpuSet> &res) {
+        return [&res]() { res.set_value(cor::get_affinity()); };
+    };
+
+    cor::TaskQueue q(cor::CpuSet{cpu});
+    std::promise<cor::CpuSet> queue_affinity;
+    q.enqueue(get_affinity(queue_affinity));
+    ensure("Queue is pinned"
+           , queue_affinity.get_future().get() == cor::CpuSet{cpu});
+
+    for (auto placement : {cor::ThreadPool::PinCpus
+                , cor::ThreadPool::SpreadNodes}) {
+        cor::ThreadPool pool(3, placement, allowed);
+        std::vector<std::promise<cor::CpuSet> > res(6);
+        for (auto &p : res)
+            pool.enqueue(get_affinity(p));
+        for (auto &p : res) {
+            auto cpus = p.get_future().get();
+            ensure("Worker is pinned to allowed CPUs"
+                   , !cpus.empty() && (cpus & allowed) == cpus);
+            if (placement == cor::ThreadPool::PinCpus)
+                ensure_eq("Worker is pinned to CPU", cpus.size(), 1u);
+        }
+    }
+
+    try {
+        cor::ThreadPool pool(2, cor::ThreadPool::PinCpus, cor::CpuSet());
+        fail("Workers can't be pinned to empty set");
+    } catch (cor::Error const &) {
+    }
+    // there is no such CPU
+    cor::CpuSet absent{CPU_SETSIZE - 1};
+    try {
+        cor::ThreadPool pool(2, cor::ThreadPool::PinCpus, absent);
+        fail("Workers can't be pinned to absent CPU");
+    } catch (cor::CError const &) {
+    }
+    try {
+        cor::TaskQueue q(absent);
+        fail("Queue can't be pinned to absent CPU");
+    } catch (cor::CError const &) {
+    }
+}
+
+template<> template<>
+void object::test<tid_task_queue_stats>()
+{
+    cor::Histogram h;
+    for (uint64_t v = 1; v <= 1000; ++v)
+        h.record(v);
+    auto hs = h.snapshot();
+    ensure_eq("Count", hs.count, 1000u);
+    ensure_eq("Max", hs.max, 1000u);
+    ensure_eq("Mean", hs.mean(), 500.5);
+    auto p50 = hs.percentile(50), p99 = hs.percentile(99);
+    ensure("Median within bucket error", p50 >= 500 && p50 < 625);
+    ensure("p99 within bucket error", p99 >= 990 && p99 <= 1000);
+    ensure_eq("p100 is max", hs.percentile(100), 1000u);
+    for (unsigned i = 0; i <= cor::Histogram::index(~0ULL); ++i)
+        ensure_eq("Value is in own bucket"
+                  , cor::Histogram::index(cor::Histogram::upper_bound(i)), i);
+
+    using namespace std::chrono;
+    cor::TaskQueue q;
+    q.enable_stats(true);
+    auto before = q.stats();
+    ensure_eq("Nothing is executed", before.executed, 0u);
+
+    static const size_t count = 20;
+    cor::Completion done;
+    for (size_t i = 0; i < count; ++i)
+        done.up();
+    q.enqueue([]() { std::this_thread::sleep_for(milliseconds(10)); });
+    for (size_t i = 0; i < count; ++i)
+        q.enqueue([&done]() { done.down(); });
+    done.wait();
+    // counters are updated after tasks are executed and the queue is
+    // drained, so they are polled
+    cor::TaskQueue::Stats after;
+    ensure("All are counted", wait_while([&q, &after]() {
+                after = q.stats();
+                return after.executed != count + 1
+                    || after.run_time.count != count + 1
+                    || after.idle == std::chrono::nanoseconds(0);
+            }, 5000));
+
+    ensure_eq("All are executed", after.executed, count + 1);
+    ensure_eq("All are measured", after.run_time.count, count + 1);
+    ensure_eq("Latency of all is measured", after.latency.count, count + 1);
+    ensure("Run time of the slow task is recorded"
+           , after.run_time.max >= 10000000u);
+    ensure("Tasks waited for the slow one"
+           , after.latency.percentile(90) >= 5000000u);
+    ensure("Queue was idle", after.idle > nanoseconds(0));
+    ensure("Throughput is calculated", after.throughput(before) > 0);
+    ensure_eq("No tasks are queued", after.depth[cor::TaskQueue::Normal], 0u);
+}
+
+template<> template<>
+void object::test<tid_thread_pool_start_error>()
+{
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+    // sanitizers reserve huge address space, the limit can't be set
+    return;
+#else
+    // thread creation failure is injected by limiting the address
+    // space, so it is done in the child process
+    auto pid = ::fork();
+    ensure("Forked", pid >= 0);
+    if (!pid) {
+        long pages = 0;
+        std::ifstream("/proc/self/statm") >> pages;
+        // enough for a few worker stacks
+        rlimit limit;
+        limit.rlim_cur = limit.rlim_max
+            = pages * ::sysconf(_SC_PAGESIZE) + (32 << 20);
+        int rc = 2;
+        if (pages && !::setrlimit(RLIMIT_AS, &limit)) {
+            try {
+                cor::ThreadPool pool(64);
+                rc = 1;
+            } catch (std::system_error const &) {
+                rc = 0;
+            } catch (std::bad_alloc const &) {
+                rc = 0;
+            }
+        }
+        ::_exit(rc);
+    }
+    int status = 0;
+    ensure_eq("Child is finished", ::waitpid(pid, &status, 0), pid);
+    ensure("Child is not crashed", WIFEXITED(status));
+    ensure_eq("Start error is thrown", WEXITSTATUS(status), 0);
+#endif
+}
+
 }
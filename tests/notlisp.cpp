@@ -1,6 +1,7 @@
 #include <cor/notlisp.hpp>
 #include <cor/sexp.hpp>
 #include <cor/util.hpp>
+#include <cor/mt.hpp>
 #include <tut/tut.hpp>
 
 #include <sys/types.h>
@@ -9,8 +10,14 @@
 
 #include <tuple>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <fstream>
+#include <iterator>
 #include <stdexcept>
+#include <cstring>
 
 namespace tut
 {
@@ -34,7 +41,19 @@ enum test_ids {
     tid_const,
     tid_wrong_expr,
     tid_simple_fn,
-    tid_list
+    tid_list,
+    tid_cast,
+    tid_native,
+    tid_stream,
+    tid_reuse,
+    tid_profile,
+    tid_form_cache,
+    tid_limits,
+    tid_vector,
+    tid_dict,
+    tid_snapshot,
+    tid_parallel,
+    tid_broken_snapshot
 };
 
 template<> template<>
@@ -261,4 +280,856 @@ void object::test<tid_list>()
         });
 }
 
+template<> template<>
+void object::test<tid_cast>()
+{
+    using namespace cor::notlisp;
+
+    class Custom : public ObjectExpr
+    {
+    public:
+        Custom() : ObjectExpr("custom") {}
+    };
+
+    expr_list_type src{mk_value(1L), mk_string("s"), mk_keyword("k"),
+            mk_symbol("sym"), mk_lambda("fn", lambda_type()),
+            mk_list(expr_list_type()), std::make_shared<Custom>()};
+
+    ListAccessor params(src);
+    ensure("PodExpr", !!params.required<PodExpr>());
+    ensure("String", !!params.required<String>());
+    ensure("Keyword", !!params.required<Keyword>());
+    ensure("SymbolExpr", !!params.required<SymbolExpr>());
+    ensure("LambdaExpr", !!params.required<LambdaExpr>());
+    ensure("List", !!params.required<List>());
+    ensure("Custom", !!params.required<Custom>());
+
+    auto it = src.begin();
+    ensure("Not a string", !expr_cast<String>(*it));
+    ensure("Not a keyword", !expr_cast<Keyword>(*++it));
+    ensure("Keyword is not a string", !expr_cast<String>(*++it));
+    ensure("Not a function", !expr_cast<FunctionExpr>(*++it));
+    ensure("Lambda is a function", !!expr_cast<FunctionExpr>(*++it));
+    ensure("List is an object", !!expr_cast<ObjectExpr>(*++it));
+    ensure("List is not custom", !expr_cast<Custom>(*it));
+    ensure("Custom is not a list", !expr_cast<List>(*++it));
+    ensure("Custom is an object", !!expr_cast<ObjectExpr>(*it));
+    ensure("Null is not casted", !expr_cast<Expr>(expr_ptr()));
+
+    // user classes derived directly from Expr are not ObjectExpr or
+    // FunctionExpr despite their type
+    class RawObject : public Expr
+    {
+    public:
+        RawObject() : Expr("raw", Expr::Object) {}
+    protected:
+        virtual expr_ptr do_eval(env_ptr, expr_ptr self) { return self; }
+    };
+
+    class RawFunction : public Expr
+    {
+    public:
+        RawFunction() : Expr("raw-fn", Expr::Function) {}
+    protected:
+        virtual expr_ptr do_eval(env_ptr, expr_ptr self) { return self; }
+    };
+
+    expr_ptr raw_object = std::make_shared<RawObject>();
+    expr_ptr raw_function = std::make_shared<RawFunction>();
+    ensure("Raw object is not ObjectExpr", !expr_cast<ObjectExpr>(raw_object));
+    ensure("Raw object is casted", !!expr_cast<RawObject>(raw_object));
+    ensure("Raw function is not FunctionExpr"
+           , !expr_cast<FunctionExpr>(raw_function));
+    ensure("Vector is an object"
+           , !!expr_cast<ObjectExpr>(mk_vector(std::vector<long>{1})));
+    ensure("Dict is an object", !!expr_cast<ObjectExpr>(mk_dict({})));
+
+    ListAccessor all(src);
+    std::list<std::shared_ptr<ObjectExpr> > objects;
+    ensure_throws<Error>("Not all are objects", [&all, &objects]() {
+            push_rest_casted(all, objects);
+        });
+    ensure_eq("Nothing is pushed", objects.size(), 0);
+}
+
+namespace {
+
+std::string native_concat(std::string const &a, long n)
+{
+    std::string res;
+    for (long i = 0; i < n; ++i)
+        res += a;
+    return res;
+}
+
+}
+
+template<> template<>
+void object::test<tid_native>()
+{
+    using namespace cor::notlisp;
+    using cor::sexp::parse;
+
+    int calls = 0;
+    auto scale = [](double v, long factor, long offset) {
+        return v * factor + offset;
+    };
+    auto count = [&calls]() { ++calls; };
+    env_ptr env(new Env({
+                mk_native("concat", &native_concat),
+                mk_native("scale", scale, {"v", "factor", "offset"}, 2, 0),
+                mk_native("count", count)
+            }));
+
+    auto exec = [&env] (std::string const &src) {
+        std::istringstream in(src);
+        Interpreter interpreter(env);
+        parse(in, interpreter);
+        return interpreter.results();
+    };
+
+    std::string s;
+    auto values1 = exec("(concat \"ab\" 2)");
+    ListAccessor res1(values1);
+    res1.required(to_string, s);
+    ensure_eq("concat", s, "abab");
+
+    double d = 0;
+    auto values2 = exec("(scale 1.5) (scale 1.5 4) (scale :offset 1 1.0)"
+                        " (scale :factor 3 :v 2.0 :offset 1)");
+    ListAccessor res2(values2);
+    res2.required(to_double, d);
+    ensure_eq("all defaults", d, 3.0);
+    res2.required(to_double, d);
+    ensure_eq("one default", d, 6.0);
+    res2.required(to_double, d);
+    ensure_eq("keyword and positional", d, 3.0);
+    res2.required(to_double, d);
+    ensure_eq("keywords", d, 7.0);
+
+    auto values3 = exec("(count) (count)");
+    ListAccessor res3(values3);
+    ensure_eq("called twice", calls, 2);
+    ensure_eq("void returns nil", res3.required()->type(), Expr::Nil);
+
+    ensure_throws<cor::Error>("Wrong param type", [&exec]() {
+            exec("(concat 1 2)");
+        });
+    ensure_throws<cor::Error>("Required param", [&exec]() {
+            exec("(concat \"a\")");
+        });
+    ensure_throws<cor::Error>("Too many params", [&exec]() {
+            exec("(count 1)");
+        });
+    ensure_throws<cor::Error>("Unknown keyword", [&exec]() {
+            exec("(scale :x 1.0)");
+        });
+    ensure_throws<cor::Error>("Param is set twice", [&exec]() {
+            exec("(scale 1.0 :v 1.0)");
+        });
+    ensure_throws<Error>("Names count", []() {
+            mk_native("concat", &native_concat, {"a"});
+        });
+}
+
+template<> template<>
+void object::test<tid_stream>()
+{
+    using namespace cor::notlisp;
+    using cor::sexp::parse;
+
+    env_ptr env(new Env({
+                mk_record("list", [](env_ptr, expr_list_type &params) {
+                        return mk_list(params); }),
+                    }));
+    Interpreter interpreter(env);
+    std::list<std::weak_ptr<Expr> > seen;
+    long sum = 0;
+    interpreter.set_result_handler([&seen, &sum](expr_ptr res) {
+            seen.push_back(res);
+            auto l = expr_cast<List>(res);
+            sum += l ? l->items.size() : (long)*res;
+        });
+
+    std::istringstream in("1 (list 2 (list 3) 4) (list) 5");
+    parse(in, interpreter);
+    ensure_eq("Each top-level result is handled", seen.size(), 4);
+    ensure_eq("Results are handled", sum, 9);
+    ensure_eq("Results are not accumulated",
+              interpreter.results().size(), 0);
+    for (auto const &p : seen)
+        ensure("Result is released", p.expired());
+}
+
+template<> template<>
+void object::test<tid_reuse>()
+{
+    using namespace cor::notlisp;
+    using cor::sexp::parse;
+
+    env_ptr env(new Env({
+                mk_record("list", [](env_ptr, expr_list_type &params) {
+                        return mk_list(params); }),
+                    }));
+    Interpreter interpreter(env);
+    std::istringstream in("(list 1 (list 2");
+    parse(in, interpreter);
+    ensure_eq("Unfinished list on top", interpreter.results().size(), 2);
+    interpreter.reset();
+    ensure_eq("No results after reset", interpreter.results().size(), 0);
+
+    std::vector<std::string> inputs{"1 2", "(list 1 (list 2 3))", "\"s\""};
+    std::vector<size_t> sizes;
+    interpreter.eval_batch(inputs, [&sizes](size_t i, expr_list_type &res) {
+            ensure_eq("Sequential", i, sizes.size());
+            sizes.push_back(res.size());
+        });
+    std::vector<size_t> expected{2, 1, 1};
+    ensure("Batch results", sizes == expected);
+    ensure_eq("Last results are kept", interpreter.results().size(), 1);
+
+    inputs = {"1", "(x)", "2"};
+    sizes.clear();
+    auto handler = [&sizes](size_t, expr_list_type &res) {
+        sizes.push_back(res.size());
+    };
+    ensure_throws<Error>("Batch fails", [&]() {
+            interpreter.eval_batch(inputs, handler);
+        });
+    ensure_eq("Only first input is handled", sizes.size(), 1);
+
+    sizes.clear();
+    inputs = {"1", "(x)", ")", "2 3"};
+    std::vector<size_t> failed;
+    interpreter.eval_batch(inputs, handler, [&failed](size_t i, cor::Error const &) {
+            failed.push_back(i);
+        });
+    std::vector<size_t> expected_failed{1, 2};
+    ensure("Failed inputs are reported", failed == expected_failed);
+    expected = {1, 2};
+    ensure("The rest is evaluated", sizes == expected);
+    inputs = {"3 4"};
+    interpreter.eval_batch(inputs, handler);
+    ensure_eq("Interpreter can be reused", sizes.back(), 2);
+}
+
+template<> template<>
+void object::test<tid_profile>()
+{
+    using namespace cor::notlisp;
+    using cor::sexp::parse;
+
+    auto profiler = std::make_shared<Profiler>();
+    env_ptr env(new Env({
+                mk_record("list", [](env_ptr, expr_list_type &params) {
+                        return mk_list(params); }),
+                mk_record("sleep", [](env_ptr, expr_list_type &) {
+                        std::this_thread::sleep_for
+                            (std::chrono::milliseconds(2));
+                        return mk_nil(); }),
+                    }));
+    auto outer_fn = [profiler](env_ptr env, expr_list_type &) {
+        Interpreter nested(env);
+        nested.set_profiler(profiler);
+        std::istringstream in("(sleep)");
+        parse(in, nested);
+        return mk_nil();
+    };
+    env->dict["outer"] = mk_lambda("outer", outer_fn);
+
+    Interpreter interpreter(env);
+    interpreter.set_profiler(profiler);
+    std::istringstream in("(list 1 2 (list 3)) (sleep) (outer)");
+    parse(in, interpreter);
+
+    auto stats = profiler->snapshot();
+    ensure_eq("3 functions", stats.size(), 3);
+    ensure_eq("list is called twice", stats["list"].calls, 2);
+    ensure_eq("list creates 2 lists", stats["list"].exprs, 2);
+    ensure_eq("sleep is called twice", stats["sleep"].calls, 2);
+    ensure("sleep time",
+           stats["sleep"].total >= std::chrono::milliseconds(4));
+    ensure_eq("sleep self time", stats["sleep"].self.count(),
+              stats["sleep"].total.count());
+    auto const &outer = stats["outer"];
+    ensure("outer includes nested sleep",
+           outer.total >= std::chrono::milliseconds(2));
+    ensure("outer self time excludes nested sleep",
+           outer.self < std::chrono::milliseconds(2));
+
+    std::ostringstream out;
+    out << stats;
+    ensure("Snapshot dump",
+           out.str().find("sleep calls=2") != std::string::npos);
+
+    profiler->clear();
+    ensure_eq("Cleared", profiler->snapshot().size(), 0);
+}
+
+template<> template<>
+void object::test<tid_form_cache>()
+{
+    using namespace cor::notlisp;
+
+    int resolved = 0;
+    auto convert = [&resolved](std::string &&s) {
+        ++resolved;
+        return default_atom_convert(std::move(s));
+    };
+    env_ptr env(new Env({
+                mk_native("add", [](long a, long b) { return a + b; }),
+                mk_native("cat", [](std::string const &a,
+                                    std::string const &b) {
+                              return a + b; }),
+                mk_record("list", [](env_ptr, expr_list_type &params) {
+                        return mk_list(params); }),
+                    }));
+    FormCache cache(env, 2, convert);
+
+    auto eval_long = [&cache](std::string const &src) {
+        auto res = cache.eval(src);
+        ensure_eq("One result", res.size(), 1);
+        long v = 0;
+        to_long(res.front(), v);
+        return v;
+    };
+
+    ensure_eq("1st", eval_long("(add 1 (add 2 3))"), 6);
+    ensure_eq("Other literals", eval_long("(add 10 (add 20 30))"), 60);
+    auto stats = cache.stats();
+    ensure_eq("1 miss", stats.misses, 1);
+    ensure_eq("1 hit", stats.hits, 1);
+    ensure_eq("Symbols are resolved once, literals each time", resolved, 8);
+
+    auto res = cache.eval("(cat \"a\" \"b\") (list 1 :k 2)");
+    ensure_eq("2 results", res.size(), 2);
+    std::string s;
+    to_string(res.front(), s);
+    ensure_eq("String literals", s, "ab");
+    auto l = expr_cast<List>(res.back());
+    ensure("List", !!l);
+    ensure_eq("List with keyword", l->items.size(), 3);
+
+    // escaped input is handled by the full parser, shape is the same
+    auto misses = cache.stats().misses;
+    res = cache.eval("(cat \"a\\\"\" \"b\") (list 1 :k 2) ; comment");
+    ensure_eq("Escaped input has the same shape", cache.stats().misses, misses);
+    to_string(res.front(), s);
+    ensure_eq("Escaped string literal", s, "a\"b");
+    ensure_throws<cor::Error>("Unbalanced input", [&cache]() {
+            cache.eval("(cat \"a\" \"b\"))");
+        });
+
+    ensure_eq("Different shape", eval_long("(add (add 1 2) 3)"), 6);
+    stats = cache.stats();
+    ensure_eq("3 misses", stats.misses, 3);
+    ensure_eq("LRU is evicted", stats.evictions, 1);
+    ensure_eq("Bounded size", stats.size, 2);
+    eval_long("(add 1 (add 2 3))");
+    ensure_eq("Evicted form is compiled again", cache.stats().misses, 4);
+
+    ensure_throws<Error>("Empty expression", [&cache]() {
+            cache.eval("()");
+        });
+    ensure_throws<Error>("Not a function", [&cache]() {
+            cache.eval("(1 2)");
+        });
+
+    auto profiler = std::make_shared<Profiler>();
+    cache.set_profiler(profiler);
+    eval_long("(add 1 (add 2 3))");
+    ensure_eq("Cached calls are profiled", profiler->snapshot()["add"].calls, 2);
+    cache.clear();
+    ensure_eq("Cleared", cache.stats().size, 0);
+}
+
+template<> template<>
+void object::test<tid_limits>()
+{
+    using namespace cor::notlisp;
+    using cor::sexp::parse;
+
+    env_ptr env(new Env({
+                mk_record("list", [](env_ptr, expr_list_type &params) {
+                        return mk_list(params); }),
+                    }));
+
+    typedef std::function<size_t (std::string const &, Limits const &)>
+        exec_type;
+    auto interpret = [&env](std::string const &src, Limits const &limits) {
+        Interpreter interpreter(env);
+        interpreter.set_limits(limits);
+        std::istringstream in(src);
+        parse(in, interpreter);
+        return interpreter.results().size();
+    };
+    FormCache cache(env, 8);
+    auto cached = [&cache](std::string const &src, Limits const &limits) {
+        // form is compiled w/o limits, so limits are hit by the
+        // cached form
+        cache.set_limits(Limits());
+        cache.eval(src);
+        cache.set_limits(limits);
+        return cache.eval(src).size();
+    };
+
+    Limits limits;
+    for (exec_type exec : std::vector<exec_type>{interpret, cached}) {
+        auto check = [&exec](std::string const &src, Limits const &limits,
+                             LimitExceeded::Limit expected) {
+            try {
+                exec(src, limits);
+            } catch (LimitExceeded const &e) {
+                ensure_eq("Exceeded limit", e.limit, expected);
+                return;
+            }
+            fail("LimitExceeded is expected");
+        };
+
+        limits = Limits();
+        limits.steps = 10;
+        ensure_eq("Within steps limit", exec("(list 1 2) 3", limits), 2);
+        check("(list 1 2 3 4 5 6 7 8 9 10)", limits, LimitExceeded::Steps);
+
+        limits = Limits();
+        limits.depth = 3;
+        ensure_eq("Within depth limit"
+                  , exec("(list (list (list 1)))", limits), 1);
+        check("(list (list (list (list 1))))", limits, LimitExceeded::Depth);
+
+        limits = Limits();
+        limits.allocs = 10;
+        ensure_eq("Within allocs limit", exec("(list 1 2)", limits), 1);
+        check("(list 1 2 3 4 5 6 7 8 9 10)", limits
+              , LimitExceeded::Allocations);
+    }
+
+    limits = Limits();
+    limits.steps = 10;
+    cache.set_limits(limits);
+    for (int i = 0; i < 3; ++i)
+        ensure_eq("Budget is reset for each input"
+                  , cache.eval("(list 1 2) 3").size(), 2);
+
+    limits = Limits();
+    limits.steps = 5;
+    Interpreter interpreter(env);
+    interpreter.set_limits(limits);
+    std::istringstream in("1 2 3");
+    parse(in, interpreter);
+    interpreter.reset();
+    in.str("4 5 6");
+    in.clear();
+    parse(in, interpreter);
+    ensure_eq("Budget is reset", interpreter.results().size(), 3);
+}
+
+template<> template<>
+void object::test<tid_vector>()
+{
+    using namespace cor::notlisp;
+    using cor::sexp::parse;
+
+    auto records = vector_records();
+    env_ptr env(new Env({
+                mk_record("list", [](env_ptr, expr_list_type &params) {
+                        return mk_list(params); }),
+                    }));
+    env->dict.insert(records.begin(), records.end());
+
+    auto exec = [&env](std::string const &src) {
+        Interpreter interpreter(env);
+        std::istringstream in(src);
+        parse(in, interpreter);
+        ensure_eq("One result", interpreter.results().size(), 1);
+        return interpreter.results().front();
+    };
+
+    auto v = exec("(vector 1 2 3)");
+    auto lv = expr_cast<Vector<long> >(v);
+    ensure("Integer vector", !!lv);
+    std::vector<long> expected{1, 2, 3};
+    ensure("Values", lv->items == expected);
+    ensure("Not a real vector", !expr_cast<Vector<double> >(v));
+
+    std::vector<double> reals;
+    to_vector(v, reals);
+    ensure_eq("Converted to reals", reals.size(), 3);
+    ensure_eq("Converted value", reals[2], 3.0);
+    to_vector(exec("(list 1 2.5)"), reals);
+    ensure_eq("List to reals", reals[1], 2.5);
+    std::vector<long> longs;
+    ensure_throws<Error>("Reals are not converted to integers", [&]() {
+            to_vector(exec("(vector 1 2.5)"), longs);
+        });
+
+    auto get_long = [&exec](std::string const &src) {
+        long res = 0;
+        to_long(exec(src), res);
+        return res;
+    };
+    auto get_double = [&exec](std::string const &src) {
+        double res = 0;
+        to_double(exec(src), res);
+        return res;
+    };
+    ensure_eq("Sum", get_long("(vector-sum (vector 1 2 3))"), 6);
+    ensure_eq("Real sum", get_double("(vector-sum (vector 1 2.5))"), 3.5);
+    ensure_eq("Min", get_long("(vector-min (vector 3 1 2))"), 1);
+    ensure_eq("Max", get_double("(vector-max (vector 3 1.5 2))"), 3.0);
+    ensure_eq("Dot", get_long("(vector-dot (vector 1 2 3) (vector 4 5 6))"),
+              32);
+    ensure_eq("Real dot", get_double("(vector-dot (vector 1 2) "
+                                     "(vector 0.5 0.25))"), 1.0);
+    ensure_eq("Scale", get_long("(vector-sum (vector-scale (vector 1 2) 3))"),
+              9);
+    ensure_eq("Real scale",
+              get_double("(vector-sum (vector-scale (vector 1 2) 0.5))"), 1.5);
+
+    ensure_throws<cor::Error>("Empty vector has no min", [&exec]() {
+            exec("(vector-min (vector))");
+        });
+    ensure_throws<cor::Error>("Different sizes", [&exec]() {
+            exec("(vector-dot (vector 1) (vector 1 2))");
+        });
+    ensure_throws<cor::Error>("Not a number", [&exec]() {
+            exec("(vector 1 \"2\")");
+        });
+}
+
+template<> template<>
+void object::test<tid_dict>()
+{
+    using namespace cor::notlisp;
+    using cor::sexp::parse;
+
+    auto records = dict_records();
+    env_ptr env(new Env({
+                mk_record("opts", [](env_ptr, expr_list_type &params) {
+                        ListAccessor src(params);
+                        Dict::map_type opts;
+                        long count = 0;
+                        rest_dict(src, opts, [&count](expr_ptr const &) {
+                                ++count;
+                            });
+                        ensure_eq("Positional args", count, 2);
+                        return opts.at("b"); }),
+                    }));
+    env->dict.insert(records.begin(), records.end());
+
+    auto exec = [&env](std::string const &src) {
+        Interpreter interpreter(env);
+        std::istringstream in(src);
+        parse(in, interpreter);
+        ensure_eq("One result", interpreter.results().size(), 1);
+        return interpreter.results().front();
+    };
+
+    auto d = expr_cast<Dict>(exec("(dict :a 1 :b \"x\" :c 2.5 :a 3)"));
+    ensure("Dict", !!d);
+    ensure_eq("Keys", d->items.size(), 3);
+    long a = 0;
+    to_long(d->get("a"), a);
+    ensure_eq("Last value is used", a, 3);
+    ensure("No such key", !d->get("d"));
+
+    std::string s;
+    to_string(exec("(dict-get (dict :a 1 :b \"x\") :b)"), s);
+    ensure_eq("Get by keyword", s, "x");
+    to_string(exec("(dict-get (dict :b \"y\") \"b\")"), s);
+    ensure_eq("Get by string", s, "y");
+    ensure_eq("Absent key", exec("(dict-get (dict) :b)")->type(), Expr::Nil);
+
+    to_string(exec("(opts 1 :a 2 :b \"z\" 3)"), s);
+    ensure_eq("Keyword args with positional", s, "z");
+
+    ensure_throws<cor::Error>("Positional args", [&exec]() {
+            exec("(dict :a 1 2)");
+        });
+    ensure_throws<cor::Error>("Orphaned keyword", [&exec]() {
+            exec("(dict :a)");
+        });
+}
+
+template<> template<>
+void object::test<tid_snapshot>()
+{
+    using namespace cor::notlisp;
+
+    char dir_name[] = "/tmp/cor-notlisp.XXXXXX";
+    ensure("Temporary dir", ::mkdtemp(dir_name) != nullptr);
+    std::string path = std::string(dir_name) + "/config.snapshot";
+    auto cleanup = cor::on_scope_exit([&path, &dir_name]() {
+            ::unlink(path.c_str());
+            ::rmdir(dir_name);
+        });
+
+    int calls = 0;
+    auto vectors = vector_records();
+    auto dicts = dict_records();
+    env_ptr env(new Env({
+                mk_record("list", [&calls](env_ptr, expr_list_type &params) {
+                        ++calls;
+                        return mk_list(params); }),
+                    }));
+    env->dict.insert(vectors.begin(), vectors.end());
+    env->dict.insert(dicts.begin(), dicts.end());
+
+    std::string source("1 2.5 \"s\" :k (list 3 (list)) (vector 1 2)"
+                       " (vector 0.5) (dict :a (list 1))");
+    auto res = eval_snapshot(env, source, path);
+    ensure_eq("Evaluated", calls, 3);
+    ensure_eq("Results", res.size(), 8);
+
+    res = eval_snapshot(env, source, path);
+    ensure_eq("Loaded from snapshot", calls, 3);
+    ensure_eq("Loaded results", res.size(), 8);
+
+    ListAccessor src(res);
+    long i = 0;
+    double d = 0;
+    std::string s;
+    src.required(to_long, i).required(to_double, d).required(to_string, s);
+    ensure_eq("Integer", i, 1);
+    ensure_eq("Real", d, 2.5);
+    ensure_eq("String", s, "s");
+    auto k = src.required();
+    ensure_eq("Keyword", k->type(), Expr::Keyword);
+    ensure_eq("Keyword name", k->value(), "k");
+    auto l = src.required<List>();
+    ensure("List", !!l);
+    ensure_eq("List items", l->items.size(), 2);
+    ensure_eq("List item", l->items.front()->type(), Expr::Integer);
+    auto lv = src.required<Vector<long> >();
+    ensure("Integer vector", lv && lv->items == std::vector<long>({1, 2}));
+    auto rv = src.required<Vector<double> >();
+    ensure("Real vector", rv && rv->items == std::vector<double>({0.5}));
+    auto dv = src.required<Dict>();
+    ensure("Dict", dv && !!expr_cast<List>(dv->get("a")));
+
+    expr_list_type loaded;
+    ensure("Stale snapshot", !load_snapshot(path, source + " 3", loaded));
+    res = eval_snapshot(env, source + " (list)", path);
+    ensure_eq("Evaluated again", calls, 7);
+    ensure_eq("Snapshot is updated", load_snapshot(path, source + " (list)",
+                                                   loaded), true);
+
+    {
+        cor::FdHandle fd(::open(path.c_str(), O_WRONLY | O_TRUNC));
+        ensure("Truncate", fd.is_valid());
+        ensure_eq("Write broken", ::write(fd.value(), "nlsnap01", 8), 8);
+    }
+    ensure("Broken snapshot", !load_snapshot(path, source, loaded));
+
+    int save_errors = 0;
+    res = eval_snapshot(env, "list", path, [&save_errors](cor::Error const &) {
+            ++save_errors;
+        });
+    ensure_eq("Function is evaluated", res.front()->type(), Expr::Function);
+    ensure_eq("Save error is reported", save_errors, 1);
+    ensure("Function is not saved", !load_snapshot(path, "list", loaded));
+    ensure_throws<Error>("Save error w/o handler", [&env, &path]() {
+            eval_snapshot(env, "list", path);
+        });
+}
+
+template<> template<>
+void object::test<tid_parallel>()
+{
+    using namespace cor::notlisp;
+    using cor::sexp::parse;
+
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+    auto probe = [&mutex, &threads](env_ptr, expr_list_type &params) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.insert(std::this_thread::get_id());
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ListAccessor src(params);
+        long v = 0;
+        src.required(to_long, v);
+        if (v < 0)
+            throw Error("Negative %ld", v);
+        return mk_value(v * 2);
+    };
+    auto list = [](env_ptr, expr_list_type &params) {
+        return mk_list(params);
+    };
+    env_ptr env(new Env({
+                mk_record("probe", probe),
+                mk_record("all", list, ParamsEval::Parallel),
+                mk_record("list", list),
+                    }));
+
+    auto exec = [&env](std::string const &src) {
+        Interpreter interpreter(env);
+        std::istringstream in(src);
+        parse(in, interpreter);
+        return expr_cast<List>(interpreter.results().front());
+    };
+
+    auto res = exec("(all (probe 1) 5 (probe (probe 2)) (list (probe 3)))");
+    ensure("Result", !!res);
+    std::vector<long> values;
+    rest(res->items, [&values](expr_ptr const &e) {
+            auto l = expr_cast<List>(e);
+            long v = 0;
+            to_long(l ? l->items.front() : e, v);
+            values.push_back(v);
+            return true;
+        });
+    ensure("Parameters are in order",
+           values == std::vector<long>({2, 5, 8, 6}));
+    ensure("Evaluated concurrently", threads.size() > 1);
+
+    auto profiler = std::make_shared<Profiler>();
+    Interpreter profiled(env);
+    profiled.set_profiler(profiler);
+    std::istringstream in("(all (probe 1) (probe 2))");
+    parse(in, profiled);
+    auto stats = profiler->snapshot();
+    ensure_eq("Deferred calls are profiled", stats["probe"].calls, 2);
+    ensure_eq("Parallel function is profiled", stats["all"].calls, 1);
+
+    threads.clear();
+    res = exec("(list (probe 1) (probe 2))");
+    ensure_eq("Sequential evaluation", threads.size(), 1);
+
+    threads.clear();
+    res = exec("(all (list (probe 1)) (list (probe 2)))");
+    ensure("Nested calls are evaluated concurrently", threads.size() > 1);
+
+    {
+        // top-level results are not parameters of the Parallel function
+        Interpreter interpreter(env);
+        std::istringstream in("all (probe 1)");
+        parse(in, interpreter);
+        auto const &results = interpreter.results();
+        ensure_eq("Top-level results", results.size(), 2);
+        long v = 0;
+        to_long(results.back(), v);
+        ensure_eq("Call after Parallel function is executed", v, 2);
+    }
+
+    res = exec("(all (all (probe 1) (probe 2)) (probe 3))");
+    auto nested = res ? expr_cast<List>(res->items.front()) : nullptr;
+    ensure("Nested parallel function", nested && nested->items.size() == 2);
+    long v = 0;
+    to_long(nested->items.back(), v);
+    ensure_eq("Nested deferred calls are executed", v, 4);
+
+    // deferred calls are executed by the pool and the waiting thread
+    threads.clear();
+    auto pool = std::make_shared<cor::ThreadPool>(2);
+    Interpreter bounded(env);
+    bounded.set_executor(pool);
+    std::istringstream many("(all (probe 1) (probe 2) (probe 3) (probe 4)"
+                            " (probe 5) (probe 6) (probe 7) (probe 8))");
+    parse(many, bounded);
+    ensure("Bounded concurrency", threads.size() <= 3);
+    ensure_eq("All are executed"
+              , expr_cast<List>(bounded.results().front())->items.size(), 8);
+
+    env->dict["spin"] = mk_lambda("spin", [](env_ptr env, expr_list_type &params) {
+            ListAccessor src(params);
+            long n = 0;
+            src.required(to_long, n);
+            for (long i = 0; i < n; ++i)
+                eval(env, mk_value(i));
+            return mk_nil();
+        });
+    auto exec_limited = [&env](std::string const &src) {
+        Limits limits;
+        limits.steps = 50;
+        Interpreter interpreter(env);
+        interpreter.set_limits(limits);
+        std::istringstream in(src);
+        parse(in, interpreter);
+    };
+    exec_limited("(all (spin 10) (spin 10))");
+    ensure_throws<LimitExceeded>("Deferred call exceeds budget", [&]() {
+            exec_limited("(all (spin 10) (spin 100))");
+        });
+    ensure_throws<LimitExceeded>("Deferred calls exceed budget together"
+                                 , [&]() {
+            exec_limited("(all (spin 30) (spin 30))");
+        });
+
+    try {
+        exec("(all (probe 1) (probe -1) (probe -2))");
+        fail("Exception is expected");
+    } catch (Error const &e) {
+        ensure_eq("The first exception is propagated",
+                  std::string(e.what()), "Negative -1");
+    }
+}
+
+template<> template<>
+void object::test<tid_broken_snapshot>()
+{
+    using namespace cor::notlisp;
+
+    char dir_name[] = "/tmp/cor-notlisp.XXXXXX";
+    ensure("Temporary dir", ::mkdtemp(dir_name) != nullptr);
+    std::string path = std::string(dir_name) + "/config.snapshot";
+    auto cleanup = cor::on_scope_exit([&path, &dir_name]() {
+            ::unlink(path.c_str());
+            ::rmdir(dir_name);
+        });
+
+    auto records = vector_records();
+    auto dicts = dict_records();
+    env_ptr env(new Env({
+                mk_record("list", [](env_ptr, expr_list_type &params) {
+                        return mk_list(params); }),
+                    }));
+    env->dict.insert(records.begin(), records.end());
+    env->dict.insert(dicts.begin(), dicts.end());
+
+    std::string const source("(vector 1 2) (dict :a (list 1))");
+    eval_snapshot(env, source, path);
+    std::string data;
+    {
+        std::ifstream in(path, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(in)
+                    , std::istreambuf_iterator<char>());
+    }
+    expr_list_type loaded;
+    ensure("Snapshot is saved", load_snapshot(path, source, loaded));
+
+    auto write = [&path](std::string const &src) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(src.data(), src.size());
+    };
+    for (size_t len = 0; len < data.size(); ++len) {
+        write(data.substr(0, len));
+        ensure("Truncated snapshot", !load_snapshot(path, source, loaded));
+    }
+
+    // magic, source hash, results count, vector tag
+    size_t const vector_len = 8 + 8 + 4 + 1;
+    // vector data, dict tag
+    size_t const dict_count = vector_len + 4 + 2 * 8 + 1;
+    // key, list tag
+    size_t const list_count = dict_count + 4 + 4 + 1 + 1;
+    std::vector<std::pair<size_t, uint32_t> > const counts = {
+        {8 + 8, 2}, {vector_len, 2 * 8}, {dict_count, 1}, {list_count, 1}
+    };
+    for (auto const &count : counts) {
+        auto pos = count.first;
+        uint32_t prev = 0;
+        std::memcpy(&prev, &data[pos], sizeof(prev));
+        ensure_eq("Count offset", prev, count.second);
+        for (uint32_t v : {0x7fffffffu, 0xfffffff8u}) {
+            auto broken = data;
+            std::memcpy(&broken[pos], &v, sizeof(v));
+            write(broken);
+            ensure("Huge count", !load_snapshot(path, source, loaded));
+        }
+    }
+    ensure_eq("Loaded results are not changed", loaded.size(), 2);
+}
+
 }